@@ -0,0 +1,158 @@
+// civc benchmarks. Run with: make bench
+#include <time.h>
+#include <unistd.h> // sysconf
+#include "civ_unix.h"
+
+static double nowSec() {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char* name, S bytes, double sec) {
+  eprintf("  %-24s %8.1f MiB/s\n", name, bytes / sec / (1 << 20));
+}
+
+// A Writer which discards data, only counting the bytes.
+typedef struct { Ring ring; U2 code; S count; } NullFile;
+DECLARE_METHOD(BaseFile*, NullFile,asBase);
+DECLARE_METHOD(void,      NullFile,write);
+
+DEFINE_METHOD(BaseFile*, NullFile,asBase) { return (BaseFile*) this; }
+DEFINE_METHOD(void, NullFile,write) {
+  this->count += Ring_len(&this->ring);
+  Ring_clear(&this->ring); this->code = File_DONE;
+}
+DEFINE_METHODS(MWriter, NullFile_mWriter,
+  .asBase = M_NullFile_asBase,
+  .write  = M_NullFile_write,
+)
+
+// Log-like text: repetitive structure with varying numbers.
+static void fillLogText(Buf* b) {
+  U4 seed = 7; U1 line[128];
+  while(true) {
+    seed = seed * 1103515245 + 12345;
+    int n = snprintf(line, sizeof(line),
+      "[INFO] request id=%u path=/api/v1/items/%u status=%u took=%uus\n",
+      seed >> 8, (seed >> 4) & 0xFFF, (seed & 1) ? 200 : 404, seed & 0x3FF);
+    if(b->len + n > b->cap) return;
+    Buf_extend(b, (Slc){line, n});
+  }
+}
+
+#define LZ_REPS 200
+
+static void benchLz() {
+  eprintf("# Lz (LZ_WIN=%u)\n", LZ_WIN);
+  Buf txt = { .dat = malloc(0xF000), .cap = 0xF000 }; fillLogText(&txt);
+
+  Ring_var(wr, 1024);
+  U1 nullDat[1025];
+  NullFile nf = { .ring = Ring_init(nullDat, 1025), .code = File_DONE };
+  Writer null = { .m = NullFile_mWriter(), .d = &nf };
+  LzWriter zw; assert(LzWriter_init(&zw, wr, null, &civ.ba));
+  double start = nowSec();
+  for(int i = 0; i < LZ_REPS; i++) Writer_extend(LzWriter_asWriter(&zw), *Buf_asSlc(&txt));
+  Writer_flush(LzWriter_asWriter(&zw));
+  report("compress", txt.len * LZ_REPS, nowSec() - start);
+  eprintf("  %-24s %8.3f\n", "ratio", (double)nf.count / (txt.len * LZ_REPS));
+  LzWriter_drop(&zw);
+
+  // Compress once into memory, then time decompression.
+  U1 ringDat[1025];
+  BufFile cf = BufFile_init(Ring_init(ringDat, 1025),
+                            (Buf){ .dat = malloc(0xFFFF), .cap = 0xFFFF });
+  assert(LzWriter_init(&zw, wr, File_asWriter(BufFile_asFile(&cf)), &civ.ba));
+  Writer_extend(LzWriter_asWriter(&zw), *Buf_asSlc(&txt));
+  Writer_flush(LzWriter_asWriter(&zw)); LzWriter_drop(&zw);
+
+  Ring_var(rr, 1024);
+  Buf out = { .dat = malloc(0x1000), .cap = 0x1000 };
+  S total = 0;
+  start = nowSec();
+  for(int i = 0; i < LZ_REPS; i++) {
+    cf.b.plc = 0; cf.code = File_DONE; Ring_clear(&cf.ring);
+    LzReader zr; Ring_clear(&rr);
+    assert(LzReader_init(&zr, rr, File_asReader(BufFile_asFile(&cf)), &civ.ba));
+    Reader r = LzReader_asReader(&zr);
+    while(not Reader_eof(r)) { Reader_consume(r, &out); total += out.len; out.len = 0; }
+    LzReader_drop(&zr);
+  }
+  report("decompress", total, nowSec() - start);
+  assert(total == txt.len * LZ_REPS);
+  free(txt.dat); free(cf.b.dat); free(out.dat);
+}
+
+#define CRC_REPS 2000
+
+static void benchCrc32c() {
+  eprintf("# Crc32c\n");
+  Slc s = { .dat = malloc(0xF000), .len = 0xF000 };
+  for(U2 i = 0; i < s.len; i++) s.dat[i] = i * 31;
+  U4 crc = 0;
+  double start = nowSec();
+  for(int i = 0; i < CRC_REPS; i++) crc = crc32c(crc, s);
+  report("crc32c", s.len * CRC_REPS, nowSec() - start);
+  U4 soft = 0;
+  start = nowSec();
+  for(int i = 0; i < CRC_REPS; i++) soft = crc32cSoft(soft, s);
+  report("crc32cSoft", s.len * CRC_REPS, nowSec() - start);
+  assert(crc == soft);
+  free(s.dat);
+}
+
+#define PAR_LEN  (4 << 20)
+#define PAR_REPS 4
+
+// A few rounds of integer mixing per element: compute bound.
+static void parMixFn(void* arg, S start, S end, BBA* scratch) {
+  U4* dat = arg;
+  for(S i = start; i < end; i++) {
+    U4 x = dat[i];
+    for(int r = 0; r < 8; r++) { x ^= x >> 16; x *= 0x7feb352d; x ^= x >> 15; }
+    dat[i] = x;
+  }
+}
+
+// Returns the seconds taken with n workers.
+static double benchParN(U4* dat, U2 n, double base) {
+  UTaskPool p; UTaskWorker w[UTaskPool_MAX];
+  assert(0 == UTaskPool_init(&p, w, n));
+  double start = nowSec();
+  for(int i = 0; i < PAR_REPS; i++) UTaskPool_for(&p, PAR_LEN, 16384, parMixFn, dat);
+  double sec = nowSec() - start;
+  UTaskPool_drop(&p);
+  U1 name[32]; snprintf(name, sizeof(name), "%u workers", n);
+  report(name, PAR_LEN * sizeof(U4) * PAR_REPS, sec);
+  eprintf("  %-24s %8.2fx\n", "speedup", (base ? base : sec) / sec);
+  return sec;
+}
+
+static void benchParallelFor() {
+  U2 cores = S_min(sysconf(_SC_NPROCESSORS_ONLN), UTaskPool_MAX);
+  eprintf("# UTaskPool_for (%u cores)\n", cores);
+  U4* dat = malloc(PAR_LEN * sizeof(U4));
+  for(S i = 0; i < PAR_LEN; i++) dat[i] = i;
+  double base = benchParN(dat, 1, 0);
+  U2 n = 2;
+  for(; n <= cores; n *= 2) benchParN(dat, n, base);
+  if(n / 2 < cores) benchParN(dat, cores, base);
+  free(dat);
+}
+
+int main(int argc, char *argv[]) {
+  ARGV = argv;
+  SETUP_SIG((void *)defaultHandleSig);
+  jmp_buf errJmp; Fiber fb;
+  Fiber_init(&fb, &errJmp); Civ_init(&fb, LOG_SET_INFO);
+  if(setjmp(errJmp)) { eprintf("!! bench failed with error !!\n"); exit(1); }
+  CivUnix_init(16);
+
+  eprintf("# Starting Benchmarks\n");
+  benchLz();
+  benchCrc32c();
+  benchParallelFor();
+  eprintf("# Benchmarks Done\n");
+  CivUnix_drop();
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <assert.h>
+#include <stdarg.h>
 
 #include "civ.h"
 
@@ -7,7 +8,7 @@
 /*extern*/ const U1* emptyNt = "";
 /*extern*/ jmp_buf* err_jmp  = NULL;
 /*extern*/ U2 civErr         = 0;
-/*extern*/ Civ civ           = (Civ) {0};
+/*extern*/ _Thread_local Civ civ = (Civ) {0};
 
 I4 S_cmp(S l, S r) {
   if(l < r) return -1;
@@ -22,6 +23,487 @@ void Civ_init(Fiber* fb, U1 logLvl) {
   };
 }
 
+void Civ_share(BA* shared) {
+  *shared = civ.ba; civ.ba = BA_cache(shared);
+}
+
+void Civ_unshare(BA* shared) {
+  BA_dropCache(&civ.ba); civ.ba = *shared;
+  *shared = (BA) {0};
+}
+
+void Civ_initThread(Fiber* fb, Civ* from, BA* shared) {
+  civ = *from;
+  civ.fb = fb; civ.sched = NULL;
+  civ.ba = BA_cache(shared);
+}
+
+void Civ_dropThread() { BA_dropCache(&civ.ba); }
+
+// #################################
+// # Fiber
+
+#if FIBER_ASM
+// void fiberSwap(void** save, void* to): push the callee-saved registers,
+// save the stack pointer to *save, then switch to `to` and pop its registers.
+// The return address on `to`'s stack is where it resumes.
+void fiberSwap(void** save, void* to);
+#if defined(__x86_64__)
+#define FIBER_REGS 6
+__asm__(
+  ".text\n"
+  ".globl fiberSwap\n"
+  ".type fiberSwap, @function\n"
+  "fiberSwap:\n"
+  "  pushq %rbp\n  pushq %rbx\n  pushq %r12\n"
+  "  pushq %r13\n  pushq %r14\n  pushq %r15\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  popq %r15\n  popq %r14\n  popq %r13\n"
+  "  popq %r12\n  popq %rbx\n  popq %rbp\n"
+  "  ret\n"
+  ".size fiberSwap, .-fiberSwap\n"
+);
+#else // i386 (cdecl)
+#define FIBER_REGS 4
+__asm__(
+  ".text\n"
+  ".globl fiberSwap\n"
+  ".type fiberSwap, @function\n"
+  "fiberSwap:\n"
+  "  movl 4(%esp), %eax\n"
+  "  movl 8(%esp), %edx\n"
+  "  pushl %ebp\n  pushl %ebx\n  pushl %esi\n  pushl %edi\n"
+  "  movl %esp, (%eax)\n"
+  "  movl %edx, %esp\n"
+  "  popl %edi\n  popl %esi\n  popl %ebx\n  popl %ebp\n"
+  "  ret\n"
+  ".size fiberSwap, .-fiberSwap\n"
+);
+#endif
+#endif // FIBER_ASM
+
+// Entry point of every new fiber (the fiber is already civ.fb).
+static void Fiber_run() {
+  Fiber* fb = civ.fb;
+  jmp_buf errJmp; fb->errJmp = &errJmp;
+  if(setjmp(errJmp)) fb->state |= Fiber_ERR;
+  else               fb->fn(fb->arg);
+  fb->state |= Fiber_DONE;
+  Fiber_switch(fb->caller);
+  assert(false); // DONE fibers are never resumed
+}
+
+void Fiber_new(Fiber* fb, U1* stack, S stackSz, void (*fn)(void* arg), void* arg) {
+  *fb = (Fiber) { .fn = fn, .arg = arg, .stack = stack, .stackSz = stackSz };
+#if FIBER_ASM
+  // Build the stack fiberSwap expects: registers, then the return address
+  // (Fiber_run), then a fake return address for Fiber_run so that the stack
+  // is aligned as though it were called.
+  S* sp = (S*)(((S)stack + stackSz) & ~(S)15);
+  *--sp = 0;
+  *--sp = (S)Fiber_run;
+  for(int i = 0; i < FIBER_REGS; i++) *--sp = 0;
+  fb->sp = sp;
+#else
+  getcontext(&fb->ctx);
+  fb->ctx.uc_stack.ss_sp = stack; fb->ctx.uc_stack.ss_size = stackSz;
+  fb->ctx.uc_link = NULL;
+  makecontext(&fb->ctx, Fiber_run, 0);
+#endif
+}
+
+bool Fiber_alloc(Fiber* fb, Arena a, S stackSz, void (*fn)(void*), void* arg) {
+  U1* stack = Xr(a,alloc, stackSz, 16);
+  if(not stack) return false;
+  Fiber_new(fb, stack, stackSz, fn, arg);
+  return true;
+}
+
+void Fiber_free(Fiber* fb, Arena a) {
+  Xr(a,free, fb->stack, fb->stackSz, 16);
+  fb->stack = NULL;
+}
+
+void Fiber_switch(Fiber* to) {
+  Fiber* from = civ.fb;
+  if(from == to) return;
+  ASSERT(not (to->state & Fiber_DONE), "Fiber_switch: fiber is done");
+  to->caller = from;
+  civ.fb = to;
+#if FIBER_ASM
+  fiberSwap(&from->sp, to->sp);
+#else
+  swapcontext(&from->ctx, &to->ctx);
+#endif
+}
+
+// #################################
+// # TimerWheel
+
+#define TIMER_MASK   (TIMER_SLOTS - 1)
+
+void TimerWheel_init(TimerWheel* w, U8 tickNs, U8 now) {
+  *w = (TimerWheel) { .tick = now / tickNs, .tickNs = tickNs };
+}
+
+// Put t in its slot relative to the current tick (t->at >= w->tick).
+static void TimerWheel_place(TimerWheel* w, Timer* t) {
+  U8 at = t->at;
+  if(at - w->tick >= TIMER_SPAN) at = w->tick + TIMER_SPAN - 1;
+  U8 delta = at - w->tick; U1 lvl = 0;
+  while(delta >= ((U8)TIMER_SLOTS << (TIMER_BITS * lvl))) lvl += 1;
+  Timer** slot = &w->slots[lvl][(at >> (TIMER_BITS * lvl)) & TIMER_MASK];
+  t->slot = slot; t->prev = NULL; t->next = *slot;
+  if(*slot) (*slot)->prev = t;
+  *slot = t;
+}
+
+void TimerWheel_add(TimerWheel* w, Timer* t, U8 at) {
+  ASSERT(not t->slot, "TimerWheel_add: already pending");
+  t->at = (at + w->tickNs - 1) / w->tickNs;
+  if(t->at <= w->tick) t->at = w->tick + 1; // fire at the next advance
+  TimerWheel_place(w, t);
+  w->len += 1;
+}
+
+void TimerWheel_cancel(TimerWheel* w, Timer* t) {
+  if(not t->slot) return;
+  if(t->prev) t->prev->next = t->next;
+  else        *t->slot = t->next;
+  if(t->next) t->next->prev = t->prev;
+  t->slot = NULL;
+  w->len -= 1;
+}
+
+// Move the current slot of each level down, while the level below wrapped.
+static void TimerWheel_cascade(TimerWheel* w) {
+  for(U1 lvl = 1; lvl < TIMER_LEVELS; lvl++) {
+    U8 i = (w->tick >> (TIMER_BITS * lvl)) & TIMER_MASK;
+    Timer* t = w->slots[lvl][i]; w->slots[lvl][i] = NULL;
+    while(t) { Timer* next = t->next; TimerWheel_place(w, t); t = next; }
+    if(i) break;
+  }
+}
+
+// The next tick at which something happens: a level 0 slot fires or a
+// non-empty slot of a higher level is cascaded. Ticks before it can be skipped.
+static U8 TimerWheel_nextTick(TimerWheel* w) {
+  U8 next = (U8)-1;
+  for(U1 lvl = 0; lvl < TIMER_LEVELS; lvl++) {
+    U1 sh = TIMER_BITS * lvl; U8 cur = w->tick >> sh;
+    for(U8 i = cur + 1; i <= cur + TIMER_SLOTS; i++) {
+      if(not w->slots[lvl][i & TIMER_MASK]) continue;
+      if((i << sh) < next) next = i << sh;
+      break;
+    }
+  }
+  return next;
+}
+
+S TimerWheel_advance(TimerWheel* w, U8 now) {
+  U8 to = now / w->tickNs; S fired = 0;
+  while(w->len) {
+    U8 tick = TimerWheel_nextTick(w);
+    if(tick > to) break;
+    w->tick = tick;
+    if(not (tick & TIMER_MASK)) TimerWheel_cascade(w);
+    Timer** slot = &w->slots[0][tick & TIMER_MASK];
+    for(Timer* t; (t = *slot); ) {
+      TimerWheel_cancel(w, t);
+      t->fn(t); fired += 1;
+    }
+  }
+  if(w->tick < to) w->tick = to;
+  return fired;
+}
+
+U8 TimerWheel_next(TimerWheel* w) {
+  if(not w->len) return (U8)-1;
+  return TimerWheel_nextTick(w) * w->tickNs;
+}
+
+// #################################
+// # Sched
+
+static void Sched_push(Sched* s, Fiber* fb) {
+  fb->next = NULL; fb->prev = s->tail;
+  if(s->tail) s->tail->next = fb;
+  else        s->head = fb;
+  s->tail = fb;
+}
+
+static Fiber* Sched_pop(Sched* s) {
+  Fiber* fb = s->head;
+  if(not fb) return NULL;
+  s->head = fb->next;
+  if(s->head) s->head->prev = NULL;
+  else        s->tail = NULL;
+  fb->next = NULL;
+  return fb;
+}
+
+void Sched_spawn(Sched* s, Fiber* fb) {
+  s->live += 1;
+  Sched_push(s, fb);
+}
+
+// Get the next runnable fiber, advancing (and waiting for) the timers and I/O.
+static Fiber* Sched_next(Sched* s) {
+  TimerWheel* w = s->timers;
+  if(w and w->len) TimerWheel_advance(w, civ.now());
+  // Don't starve I/O waiters while other fibers are runnable.
+  if(s->ioWaits and s->head and not (++s->switches % SCHED_POLL_EVERY)) {
+    s->poll(s, 0);
+  }
+  while(not s->head) {
+    bool timers = w and w->len;
+    if(not timers and not s->ioWaits) break;
+    U8 ns = (U8)-1;
+    if(timers) {
+      U8 now = civ.now(), next = TimerWheel_next(w);
+      ns = (next > now) ? next - now : 0;
+    }
+    if(s->ioWaits)                s->poll(s, ns);
+    else if(civ.sleep and ns)     civ.sleep(ns);
+    if(timers) TimerWheel_advance(w, civ.now());
+  }
+  return Sched_pop(s);
+}
+
+S Sched_run(Sched* s) {
+  Sched* prev = civ.sched; civ.sched = s;
+  s->loop = civ.fb;
+  ASSERT(civ.now or not s->timers, "Sched_run: timers require civ.now");
+  for(Fiber* fb; (fb = Sched_next(s)); ) {
+    U8 start = civ.now ? civ.now() : 0;
+    Fiber_switch(fb);
+    if(civ.now) fb->ran += civ.now() - start;
+    if(fb->state & Fiber_DONE) {
+      s->live -= 1;
+      for(Fiber* w; (w = fb->waiters); ) {
+        fb->waiters = w->next;
+        Sched_unpark(w);
+      }
+    }
+  }
+  civ.sched = prev;
+  return s->live;
+}
+
+void Sched_yield() {
+  Sched* s = civ.sched; ASSERT(s, "Sched_yield: not scheduled");
+  Sched_push(s, civ.fb);
+  Fiber_switch(s->loop);
+}
+
+void Sched_park() {
+  Sched* s = civ.sched; ASSERT(s, "Sched_park: not scheduled");
+  civ.fb->state |= Fiber_PARKED;
+  Fiber_switch(s->loop);
+}
+
+void Sched_unpark(Fiber* fb) {
+  if(not (fb->state & Fiber_PARKED)) return;
+  fb->state &= ~Fiber_PARKED;
+  Sched_push(civ.sched, fb);
+}
+
+void Sched_join(Fiber* fb) {
+  if(fb->state & Fiber_DONE) return;
+  civ.fb->next = fb->waiters; fb->waiters = civ.fb;
+  Sched_park();
+}
+
+static void Sched_timeout(Timer* t) { Sched_unpark(t->arg); }
+
+bool Sched_parkUntil(U8 at) {
+  Sched* s = civ.sched; ASSERT(s and s->timers, "Sched_parkUntil: no timers");
+  Timer t = { .fn = Sched_timeout, .arg = civ.fb };
+  TimerWheel_add(s->timers, &t, at);
+  Sched_park();
+  if(not Timer_pending(&t)) return true;
+  TimerWheel_cancel(s->timers, &t);
+  return false;
+}
+
+void Sched_sleep(U8 ns) { Sched_parkUntil(civ.now() + ns); }
+
+// #################################
+// # Chan
+// A waiting fiber adds a ChanWait (on its stack) to the channel's recvs or
+// sends list, one per channel for select, and parks. Any change wakes every
+// waiter on the relevant list, which then re-checks (and removes its own
+// waits). ChanSel.woken stops a selecting fiber being unparked twice.
+
+static void Chan_wake(ChanWait* w) {
+  for(; w; w = w->next) {
+    if(w->sel->woken) continue;
+    w->sel->woken = true;
+    Sched_unpark(w->sel->fb);
+  }
+}
+
+static void Chan_unwait(ChanWait** list, ChanWait* w) {
+  for(; *list; list = &(*list)->next) {
+    if(*list == w) { *list = w->next; return; }
+  }
+}
+
+static void Chan_wait(ChanWait** list) {
+  ASSERT(civ.sched, "Chan: would block outside a Sched");
+  ChanSel sel = { .fb = civ.fb };
+  ChanWait w = { .next = *list, .sel = &sel };
+  *list = &w;
+  Sched_park();
+  Chan_unwait(list, &w);
+}
+
+static void ChanWaiters_close(ChanWaiters* w) {
+  w->closed = true;
+  Chan_wake(w->recvs); Chan_wake(w->sends);
+}
+
+bool Chan_send(Chan* c, Slc s) {
+  while(s.len) {
+    if(c->w.closed) return false;
+    U2 moved = Ring_move(&c->ring, s);
+    if(not moved) { Chan_wait(&c->w.sends); continue; }
+    s = (Slc) { .dat = s.dat + moved, .len = s.len - moved };
+    Chan_wake(c->w.recvs);
+  }
+  return true;
+}
+
+U2 Chan_recv(Chan* c, Buf* b) {
+  ASSERT(b->len < b->cap, "Chan_recv: Buf is full");
+  while(Ring_isEmpty(&c->ring)) {
+    if(c->w.closed) return 0;
+    Chan_wait(&c->w.recvs);
+  }
+  U2 moved = Ring_consume(&c->ring, b);
+  Chan_wake(c->w.sends);
+  return moved;
+}
+
+void Chan_close(Chan* c) { ChanWaiters_close(&c->w); }
+
+bool PtrChan_trySend(PtrChan* c, void* p) {
+  ASSERT(p, "PtrChan_send: NULL");
+  if(c->w.closed or (c->len == c->cap)) return false;
+  c->buf[(c->head + c->len) % c->cap] = p;
+  c->len += 1;
+  Chan_wake(c->w.recvs);
+  return true;
+}
+
+void* PtrChan_tryRecv(PtrChan* c) {
+  if(not c->len) return NULL;
+  void* p = c->buf[c->head];
+  c->head = (c->head + 1) % c->cap; c->len -= 1;
+  Chan_wake(c->w.sends);
+  return p;
+}
+
+bool PtrChan_send(PtrChan* c, void* p) {
+  while(not PtrChan_trySend(c, p)) {
+    if(c->w.closed) return false;
+    Chan_wait(&c->w.sends);
+  }
+  return true;
+}
+
+void* PtrChan_recv(PtrChan* c) {
+  while(true) {
+    void* p = PtrChan_tryRecv(c);
+    if(p or c->w.closed) return p;
+    Chan_wait(&c->w.recvs);
+  }
+}
+
+void PtrChan_close(PtrChan* c) { ChanWaiters_close(&c->w); }
+
+// Perform case i if it can proceed.
+static bool ChanCase_try(ChanCase* c) {
+  PtrChan* ch = c->ch;
+  if(c->op == Chan_SEND) {
+    if(ch->w.closed) { c->p = NULL; return true; }
+    return PtrChan_trySend(ch, c->p);
+  }
+  c->p = PtrChan_tryRecv(ch);
+  return c->p or ch->w.closed;
+}
+
+U2 PtrChan_select(ChanCase* cases, U2 len) {
+  ASSERT(len <= Chan_SELECT_MAX, "PtrChan_select: too many cases");
+  while(true) {
+    for(U2 i = 0; i < len; i++) if(ChanCase_try(&cases[i])) return i;
+    ASSERT(civ.sched, "Chan: would block outside a Sched");
+    ChanSel sel = { .fb = civ.fb };
+    ChanWait waits[Chan_SELECT_MAX];
+    for(U2 i = 0; i < len; i++) {
+      ChanWaiters* w = &cases[i].ch->w;
+      ChanWait** list = (cases[i].op == Chan_SEND) ? &w->sends : &w->recvs;
+      waits[i] = (ChanWait) { .next = *list, .sel = &sel };
+      *list = &waits[i];
+    }
+    Sched_park();
+    for(U2 i = 0; i < len; i++) {
+      ChanWaiters* w = &cases[i].ch->w;
+      Chan_unwait((cases[i].op == Chan_SEND) ? &w->sends : &w->recvs, &waits[i]);
+    }
+  }
+}
+
+// #################################
+// # Deque
+// From "Correct and Efficient Work-Stealing for Weak Memory Models"
+// (Le, Pop, Cohen, Zappa Nardelli 2013).
+
+#define DQ_BUF(D, I)  (&(D)->buf[(I) & (D)->mask])
+
+bool Deque_push(Deque* d, Fiber* fb) {
+  ISlot b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  ISlot t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  if(b - t > (ISlot)d->mask) return false;
+  __atomic_store_n(DQ_BUF(d, b), fb, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+Fiber* Deque_pop(Deque* d) {
+  ISlot b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  ISlot t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+  Fiber* fb = NULL;
+  if(t <= b) {
+    fb = __atomic_load_n(DQ_BUF(d, b), __ATOMIC_RELAXED);
+    if(t == b) { // last one: race thieves for it
+      if(not __atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        fb = NULL;
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  return fb;
+}
+
+Fiber* Deque_steal(Deque* d) {
+  ISlot t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  ISlot b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if(t >= b) return NULL;
+  Fiber* fb = __atomic_load_n(DQ_BUF(d, t), __ATOMIC_RELAXED);
+  if(not __atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return fb;
+}
+
+__attribute__((noinline)) Fiber* Civ_fb() { return civ.fb; }
+
 void runErrPrinter() {
   if(civ.errPrinter) civ.errPrinter();
   else               defaultErrPrinter();
@@ -40,8 +522,9 @@ void handleExpectedErr(Slc expect) {
 // ####
 // # Core methods
 
-// Most APIs only align on 4 bytes (or are unaligned)
+// Alignments of 2-4 are rounded to 4 (the minimum for aligned allocations).
 #define FIX_ALIGN(A) ((A == 1) ? 1 : 4)
+#define IS_PO2(A)    ((A) and not ((A) & ((A) - 1)))
 
 S align(S ptr, U2 alignment) {
   U2 need = alignment - (ptr % alignment);
@@ -284,7 +767,7 @@ U2 Ring_move(Ring* r, Slc s) {
 #define RING_MOVE(VAR, R, B) \
   U2 VAR = Slc_move( \
     (Slc){.dat = (B)->dat + (B)->len, .len = (B)->cap - (B)->len}, \
-    Ring_avail(R)); \
+    Ring_1st(R)); \
   Ring_incHead(R, VAR); (B)->len += VAR
 
 U2 Ring_consume(Ring* r, Buf* b) {
@@ -423,6 +906,11 @@ Dll* DllRoot_pop(DllRoot* root) {
   return Dll_remove(node);
 }
 
+Dll* DllRoot_remove(DllRoot* root, Dll* node) {
+  if(root->start == node) return DllRoot_pop(root);
+  return Dll_remove(node);
+}
+
 // #################################
 // # Binary Search Tree with CStr key
 
@@ -487,14 +975,21 @@ DllRoot* BA_asDllRoot(BA* node)     { return (DllRoot*) &node->free; }
 
 BANode* BA_alloc(BA* ba) {
   BANode* out = (BANode*) DllRoot_pop(BA_asDllRoot(ba));
-  if(not out) return NULL;
+  if(not out) {
+    if(not ba->grow or not ba->grow(ba)) return NULL;
+    out = (BANode*) DllRoot_pop(BA_asDllRoot(ba));
+    if(not out) return NULL;
+  }
   ba->len -= 1;
   return out;
 }
 
+static void BA_spill(BA* cache, S n);
+
 void BA_free(BA* ba, BANode* node) {
   DllRoot_add(BA_asDllRoot(ba), BANode_asDll(node));
   ba->len += 1;
+  if(ba->parent and ba->len >= 2 * BA_BATCH) BA_spill(ba, BA_BATCH);
 }
 
 void BA_freeAll(BA* ba, BANode* nodes) {
@@ -507,19 +1002,64 @@ void BA_freeAll(BA* ba, BANode* nodes) {
 
 void BA_freeArray(BA* ba, S len, BANode nodes[], Block blocks[]) {
   for(S i = 0; i < len; i++) {
+#if BA_INTRUSIVE
+    BA_free(ba, &blocks[i].node);
+#else
     BANode* node = nodes + i;
     node->block  = blocks + i;
-    BA_free(&civ.ba, node);
+    BA_free(ba, node);
+#endif
+  }
+}
+
+void Spin_lock(U1* lock) {
+  while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {}
   }
 }
 
+void Spin_unlock(U1* lock) { __atomic_clear(lock, __ATOMIC_RELEASE); }
+
+void BA_lock(BA* ba)   { Spin_lock(&ba->lock); }
+void BA_unlock(BA* ba) { Spin_unlock(&ba->lock); }
+
+// Move up to n blocks from the cache to its parent.
+static void BA_spill(BA* cache, S n) {
+  BA* p = cache->parent;
+  BA_lock(p);
+  for(; n and cache->len; n--) {
+    cache->len -= 1;
+    BA_free(p, (BANode*)DllRoot_pop(BA_asDllRoot(cache)));
+  }
+  BA_unlock(p);
+}
+
+// Cache grow: take a batch of blocks from the parent.
+static bool BA_refill(BA* cache) {
+  BA* p = cache->parent; S n = 0;
+  BA_lock(p);
+  for(BANode* node; n < BA_BATCH and (node = BA_alloc(p)); n++) {
+    DllRoot_add(BA_asDllRoot(cache), BANode_asDll(node));
+  }
+  BA_unlock(p);
+  cache->len += n;
+  return n;
+}
+
+BA BA_cache(BA* parent) {
+  return (BA) { .parent = parent, .grow = BA_refill };
+}
+
+void BA_dropCache(BA* cache) { BA_spill(cache, cache->len); }
+
 // #################################
 // # BBA: Block Bump Arena
 
 S BBA_used(BBA* bba) {
   S used = 0;
   for(BANode* dat = bba->dat; dat; dat = dat->next) {
-    used += dat->block->bot + (BLOCK_AVAIL - dat->block->top);
+    Block* b = BANode_block(dat);
+    used += b->bot + (BLOCK_AVAIL - b->top);
   }
   return used;
 }
@@ -540,11 +1080,11 @@ DEFINE_METHOD(S, BBA,spare) {
 static Block* BBA_allocBlock(BBA* bba) {
   BANode* node = BA_alloc(bba->ba);
   if(not node) return NULL;
-  Block* b = node->block;
+  Block* b = BANode_block(node);
   b->bot = 0;
   b->top = BLOCK_AVAIL;
   DllRoot_add(BBA_asDllRoot(bba), BANode_asDll(node));
-  return node->block;
+  return b;
 }
 
 // Return block that can handle the growth or NULL
@@ -557,6 +1097,17 @@ static Block* _allocBlockIfRequired(BBA* bba, S grow) {
   return b;
 }
 
+// Alignments > 4 use the highest aligned address below top, followed by a U2
+// trailer holding the previous top (the padding is not known on free).
+static U1* BBA_allocAligned(Block* b, S sz, U2 alignment) {
+  if(b->top < b->bot + sz + sizeof(U2)) return NULL;
+  U1* out = (U1*)(((S)b + b->top - sz - sizeof(U2)) & ~(S)(alignment - 1));
+  if(out < (U1*)b + b->bot) return NULL;
+  memcpy(out + sz, &b->top, sizeof(U2));
+  b->top = out - (U1*)b;
+  return out;
+}
+
 DEFINE_METHOD(void*, BBA,alloc, S sz, U2 alignment) {
   ASSERT(sz <= BLOCK_AVAIL, "allocation sz too large");
   ASSERT(this->ba, "BBA has no ba");
@@ -569,6 +1120,18 @@ DEFINE_METHOD(void*, BBA,alloc, S sz, U2 alignment) {
     return out;
   }
   // Else grow down (aligned)
+  ASSERT(IS_PO2(alignment) and alignment <= BLOCK_SIZE, "invalid alignment");
+  if(alignment > 4) {
+    // Blocks are BLOCK_SIZE aligned, so a fresh block fits any sz + trailer.
+    ASSERT(sz + sizeof(U2) <= BLOCK_AVAIL, "allocation sz+alignment too large");
+    U1* out = NULL;
+    if(this->dat) out = BBA_allocAligned(BBA_block(this), sz, alignment);
+    if(not out) {
+      Block* b = BBA_allocBlock(this); if(not b) return NULL;
+      out = BBA_allocAligned(b, sz, alignment);
+    }
+    return out;
+  }
   sz = align(sz, FIX_ALIGN(alignment));
   Block* b = _allocBlockIfRequired(this, sz);
   if(not b) return NULL;
@@ -593,6 +1156,9 @@ DEFINE_METHOD(Slc*, BBA,free, void* data, S sz, U2 alignment) {
   if(1 == alignment) {
     if(plc != b->bot - sz) return &BBA_unorderedSz;
     b->bot = plc;
+  } else if(alignment > 4) {
+    if(plc != b->top) return &BBA_unorderedSz;
+    memcpy(&b->top, (U1*)data + sz, sizeof(U2));
   } else {
     sz = align(sz, FIX_ALIGN(alignment));
     if(plc > b->top) return &BBA_unorderedSz;
@@ -616,6 +1182,530 @@ DEFINE_METHODS(MArena, BBA_mArena,
 
 Arena BBA_asArena(BBA* d) { return (Arena) { .m = BBA_mArena(), .d = d }; }
 
+bool BBA_grow(BBA* b, void* dat, S sz, S newSz) {
+  if(not b->dat) return false;
+  Block* blk = BBA_block(b);
+  if((U1*)dat + sz != (U1*)blk + blk->bot) return false;
+  if(blk->bot - sz + newSz > blk->top) return false;
+  blk->bot = blk->bot - sz + newSz;
+  return true;
+}
+
+void* BBA_allocUp(BBA* b, S sz, U2 alignment, U1* pad) {
+  ASSERT(IS_PO2(alignment) and alignment <= RSIZE, "invalid alignment");
+  *pad = b->dat ? (-(S)BBA_block(b)->bot) & (alignment - 1) : 0;
+  if(b->dat and BBA_block(b)->bot + *pad + sz > BBA_block(b)->top)
+    *pad = 0; // a new block starts aligned
+  U1* out = BBA_alloc(b, *pad + sz, 1);
+  return out ? out + *pad : NULL;
+}
+
+BBAMark BBA_mark(BBA* b) {
+  if(not b->dat) return (BBAMark) {0};
+  return (BBAMark) {
+    .dat = b->dat, .bot = BBA_block(b)->bot, .top = BBA_block(b)->top };
+}
+
+void BBA_reset(BBA* b, BBAMark m) {
+  while(b->dat and b->dat != m.dat)
+    BA_free(b->ba, (BANode*)DllRoot_pop(BBA_asDllRoot(b)));
+  if(not b->dat) return;
+  BBA_block(b)->bot = m.bot;
+  BBA_block(b)->top = m.top;
+}
+
+// #################################
+// # Vec
+
+#define VEC_MIN 16 // minimum bytes to allocate
+
+// Elements are aligned to the largest power of two dividing esz (up to RSIZE).
+// On a BBA the storage is at the bottom of the block so it can grow in place.
+static inline U2 Vec_align(Vec* v) { return S_min(v->esz & -v->esz, RSIZE); }
+static inline bool Vec_isBBA(Vec* v) { return v->a.m == BBA_mArena(); }
+
+static void Vec_free(Vec* v) { // BBA: only frees if latest
+  if(Vec_isBBA(v)) Xr(v->a,free, v->dat - v->pad, v->pad + v->cap * v->esz, 1);
+  else             Xr(v->a,free, v->dat, v->cap * v->esz, Vec_align(v));
+}
+
+bool Vec_reserve(Vec* v, S n) {
+  if(v->len + n <= v->cap) return true;
+  S maxCap = Xr(v->a,maxAlloc) / v->esz;
+  S cap = S_min(maxCap, S_max(S_max(v->cap * 2, v->len + n), VEC_MIN / v->esz));
+  if(cap < v->len + n) return false;
+  if(v->dat and Vec_isBBA(v)
+     and BBA_grow(v->a.d, v->dat, v->cap * v->esz, cap * v->esz)) {
+    v->cap = cap;
+    return true;
+  }
+  U1 pad = 0;
+  U1* dat = Vec_isBBA(v) ? BBA_allocUp(v->a.d, cap * v->esz, Vec_align(v), &pad)
+                         : Xr(v->a,alloc, cap * v->esz, Vec_align(v));
+  if(not dat) return false;
+  if(v->dat) {
+    memcpy(dat, v->dat, v->len * v->esz);
+    Vec_free(v);
+  }
+  v->dat = dat; v->cap = cap; v->pad = pad;
+  return true;
+}
+
+void* Vec_add(Vec* v) {
+  if(not Vec_reserve(v, 1)) return NULL;
+  return v->dat + v->esz * v->len++;
+}
+
+bool Vec_extend(Vec* v, const void* dat, S n) {
+  if(not Vec_reserve(v, n)) return false;
+  memcpy(v->dat + v->esz * v->len, dat, v->esz * n);
+  v->len += n;
+  return true;
+}
+
+void Vec_drop(Vec* v) {
+  if(v->dat) Vec_free(v);
+  v->dat = NULL; v->len = 0; v->cap = 0; v->pad = 0;
+}
+
+// #################################
+// # Slab
+
+#define Slab_MAX_ALIGN 64
+
+Slab Slab_new(BA* ba, U2 slotSz) {
+  slotSz = align(S_max(slotSz, sizeof(void*)), RSIZE);
+  // Slots are aligned to the largest power of 2 dividing slotSz (up to 64).
+  U2 start = align(sizeof(SlabHdr), S_min(slotSz & -slotSz, Slab_MAX_ALIGN));
+  ASSERT(start + slotSz <= BLOCK_AVAIL, "Slab slotSz too large");
+  return (Slab) {
+    .ba = ba, .slotSz = slotSz, .start = start,
+    .slots = (BLOCK_AVAIL - start) / slotSz,
+  };
+}
+
+static void Slab_freeBlocks(Slab* s, DllRoot* root) {
+  for(Dll* d; (d = DllRoot_pop(root)); ) BA_free(s->ba, (BANode*)d);
+}
+
+DEFINE_METHOD(void, Slab,drop) {
+  Slab_freeBlocks(this, (DllRoot*)&this->partial);
+  Slab_freeBlocks(this, (DllRoot*)&this->full);
+}
+
+DEFINE_METHOD(void*, Slab,alloc, S sz, U2 alignment) {
+  ASSERT(sz <= this->slotSz, "Slab alloc sz too large");
+  ASSERT(not ((this->start | this->slotSz) & (alignment - 1)),
+         "Slab alloc: slots are not aligned enough");
+  BANode* node = this->partial;
+  if(not node) {
+    if(not (node = BA_alloc(this->ba))) return NULL;
+    Block* b = BANode_block(node);
+    ASSERT(Block_frPtr(b) == b, "Slab: unaligned block");
+    *(SlabHdr*)b = (SlabHdr) {
+      .slab = this, .node = node, .bump = this->start };
+    DllRoot_add((DllRoot*)&this->partial, BANode_asDll(node));
+  }
+  SlabHdr* h = (SlabHdr*)BANode_block(node);
+  void* out = h->free;
+  if(out) h->free = *(void**)out;
+  else {
+    out = (U1*)h + h->bump;
+    h->bump += this->slotSz;
+  }
+  if(++h->used == this->slots) {
+    DllRoot_pop((DllRoot*)&this->partial);
+    DllRoot_add((DllRoot*)&this->full, BANode_asDll(node));
+  }
+  return out;
+}
+
+Slc Slab_free_foreign = SLC("Slab free: not from this slab");
+
+DEFINE_METHOD(Slc*, Slab,free, void* data, S sz, U2 alignment) {
+  if(not data) return NULL;
+  SlabHdr* h = (SlabHdr*)Block_frPtr(data);
+  if(h->slab != this) return &Slab_free_foreign;
+  *(void**)data = h->free; h->free = data;
+  Dll* d = BANode_asDll(h->node);
+  if(h->used-- == this->slots) {
+    DllRoot_remove((DllRoot*)&this->full, d);
+    DllRoot_add((DllRoot*)&this->partial, d);
+  }
+  if(not h->used) {
+    DllRoot_remove((DllRoot*)&this->partial, d);
+    h->slab = NULL;
+    BA_free(this->ba, h->node);
+  }
+  return NULL;
+}
+
+DEFINE_METHOD(S, Slab,maxAlloc) { return this->slotSz; }
+
+DEFINE_METHODS(MArena, Slab_mArena,
+  .drop      = M_Slab_drop,
+  .free      = M_Slab_free,
+  .alloc     = M_Slab_alloc,
+  .maxAlloc  = M_Slab_maxAlloc,
+)
+
+Arena Slab_asArena(Slab* d) { return (Arena) { .m = Slab_mArena(), .d = d }; }
+
+// #################################
+// # Tlsf
+
+#define Tlsf_FREE      1
+#define Tlsf_ALIGN     8
+#define Tlsf_HDR       sizeof(TlsfHdr)
+#define Tlsf_MIN       align(Tlsf_HDR + sizeof(TlsfLinks), Tlsf_ALIGN)
+// The first chunk and the (zero sized) end sentinel. Chunk headers are at
+// offsets of 4 mod 8 so that payloads are 8 byte aligned.
+#define Tlsf_START     (align(sizeof(TlsfPool) + Tlsf_HDR, Tlsf_ALIGN) - Tlsf_HDR)
+#define Tlsf_END       (((BLOCK_AVAIL - 2 * Tlsf_HDR) & ~(Tlsf_ALIGN - 1)) + Tlsf_HDR)
+#define Tlsf_POOL      (Tlsf_END - Tlsf_START)
+#define Tlsf_MAX       (Tlsf_POOL - Tlsf_HDR)
+
+#define Tlsf_sz(H)     ((H)->sz & ~Tlsf_FREE)
+#define Tlsf_next(H)   ((TlsfHdr*)((U1*)(H) + Tlsf_sz(H)))
+#define Tlsf_links(H)  ((TlsfLinks*)((H) + 1))
+
+static inline U1 msb(U2 v) { return 31 - __builtin_clz(v); }
+
+static void Tlsf_map(U2 sz, U1* fl, U1* sl) {
+  U1 f = msb(sz);
+  *sl = (sz >> (f - Tlsf_SL_BITS)) & (Tlsf_SL - 1);
+  *fl = f - Tlsf_FL_MIN;
+}
+
+static void Tlsf_insert(Tlsf* t, TlsfHdr* h) {
+  U1 fl, sl; Tlsf_map(Tlsf_sz(h), &fl, &sl);
+  TlsfHdr* head = t->free[fl][sl];
+  *Tlsf_links(h) = (TlsfLinks) { .next = head };
+  if(head) Tlsf_links(head)->prev = h;
+  t->free[fl][sl] = h;
+  t->flMap |= 1 << fl; t->slMap[fl] |= 1 << sl;
+}
+
+static void Tlsf_remove(Tlsf* t, TlsfHdr* h) {
+  U1 fl, sl; Tlsf_map(Tlsf_sz(h), &fl, &sl);
+  TlsfLinks* l = Tlsf_links(h);
+  if(l->next) Tlsf_links(l->next)->prev = l->prev;
+  if(l->prev) Tlsf_links(l->prev)->next = l->next;
+  else if(not (t->free[fl][sl] = l->next)) {
+    t->slMap[fl] &= ~(1 << sl);
+    if(not t->slMap[fl]) t->flMap &= ~(1 << fl);
+  }
+}
+
+// Find a free chunk of at least sz (rounded up to the next size class so that
+// any chunk in the list fits).
+static TlsfHdr* Tlsf_find(Tlsf* t, U2 sz) {
+  U1 fl, sl; Tlsf_map(sz + (1 << (msb(sz) - Tlsf_SL_BITS)) - 1, &fl, &sl);
+  if(fl >= Tlsf_FL) return NULL;
+  U2 slMap = t->slMap[fl] & (~0U << sl);
+  if(not slMap) {
+    U2 flMap = t->flMap & (~0U << (fl + 1));
+    if(not flMap) return NULL;
+    fl = __builtin_ctz(flMap);
+    slMap = t->slMap[fl];
+  }
+  return t->free[fl][__builtin_ctz(slMap)];
+}
+
+static TlsfHdr* Tlsf_newPool(Tlsf* t) {
+  BANode* node = BA_alloc(t->ba);
+  if(not node) return NULL;
+  U1* b = (U1*)BANode_block(node);
+  ASSERT(Block_frPtr(b) == (Block*)b, "Tlsf: unaligned block");
+  *(TlsfPool*)b = (TlsfPool) { .tlsf = t, .node = node };
+  TlsfHdr* h = (TlsfHdr*)(b + Tlsf_START);
+  *h = (TlsfHdr) { .prevSz = 0, .sz = Tlsf_POOL | Tlsf_FREE };
+  *Tlsf_next(h) = (TlsfHdr) { .prevSz = Tlsf_POOL, .sz = 0 }; // sentinel
+  DllRoot_add((DllRoot*)&t->pools, BANode_asDll(node));
+  Tlsf_insert(t, h);
+  return h;
+}
+
+DEFINE_METHOD(void, Tlsf,drop) {
+  for(Dll* d; (d = DllRoot_pop((DllRoot*)&this->pools)); )
+    BA_free(this->ba, (BANode*)d);
+  *this = Tlsf_new(this->ba);
+}
+
+DEFINE_METHOD(void*, Tlsf,alloc, S sz, U2 alignment) {
+  ASSERT(sz <= Tlsf_MAX, "allocation sz too large");
+  U2 need = S_max(align(sz + Tlsf_HDR, Tlsf_ALIGN), Tlsf_MIN), want = need;
+  if(alignment > Tlsf_ALIGN) { // room to split off a leading (free) chunk
+    ASSERT(IS_PO2(alignment), "invalid alignment");
+    want += alignment + Tlsf_MIN;
+    if(want > Tlsf_POOL) return NULL;
+  }
+  TlsfHdr* h = Tlsf_find(this, want);
+  if(not h and not (h = Tlsf_newPool(this))) return NULL;
+  Tlsf_remove(this, h);
+  if(alignment > Tlsf_ALIGN) {
+    U1* p = (U1*)align((S)(h + 1), alignment);
+    while(p != (U1*)(h + 1) and p - (U1*)(h + 1) < Tlsf_MIN) p += alignment;
+    U2 gap = p - (U1*)(h + 1);
+    if(gap) {
+      TlsfHdr* a = (TlsfHdr*)p - 1;
+      *a = (TlsfHdr) { .prevSz = gap, .sz = Tlsf_sz(h) - gap };
+      Tlsf_next(a)->prevSz = a->sz;
+      h->sz = gap | Tlsf_FREE;
+      Tlsf_insert(this, h);
+      h = a;
+    }
+  }
+  U2 rest = Tlsf_sz(h) - need;
+  if(rest >= Tlsf_MIN) { // split
+    h->sz = need;
+    TlsfHdr* r = Tlsf_next(h);
+    *r = (TlsfHdr) { .prevSz = need, .sz = rest | Tlsf_FREE };
+    Tlsf_next(r)->prevSz = rest;
+    Tlsf_insert(this, r);
+  } else h->sz = Tlsf_sz(h);
+  return h + 1;
+}
+
+Slc Tlsf_free_foreign = SLC("Tlsf free: not from this arena");
+Slc Tlsf_free_double  = SLC("Tlsf free: already free");
+
+DEFINE_METHOD(Slc*, Tlsf,free, void* data, S sz, U2 alignment) {
+  if(not data) return NULL;
+  TlsfPool* pool = (TlsfPool*)Block_frPtr(data);
+  if(pool->tlsf != this) return &Tlsf_free_foreign;
+  TlsfHdr* h = (TlsfHdr*)data - 1;
+  if(h->sz & Tlsf_FREE) return &Tlsf_free_double;
+  TlsfHdr* n = Tlsf_next(h);
+  if(n->sz & Tlsf_FREE) { // merge next
+    Tlsf_remove(this, n);
+    h->sz += Tlsf_sz(n);
+  }
+  if(h->prevSz) {
+    TlsfHdr* p = (TlsfHdr*)((U1*)h - h->prevSz);
+    if(p->sz & Tlsf_FREE) { // merge prev
+      Tlsf_remove(this, p);
+      p->sz = Tlsf_sz(p) + h->sz;
+      h = p;
+    }
+  }
+  Tlsf_next(h)->prevSz = h->sz;
+  if(h->sz == Tlsf_POOL) {
+    DllRoot_remove((DllRoot*)&this->pools, BANode_asDll(pool->node));
+    pool->tlsf = NULL;
+    BA_free(this->ba, pool->node);
+    return NULL;
+  }
+  h->sz |= Tlsf_FREE;
+  Tlsf_insert(this, h);
+  return NULL;
+}
+
+DEFINE_METHOD(S, Tlsf,maxAlloc) { return Tlsf_MAX; }
+
+DEFINE_METHODS(MArena, Tlsf_mArena,
+  .drop      = M_Tlsf_drop,
+  .free      = M_Tlsf_free,
+  .alloc     = M_Tlsf_alloc,
+  .maxAlloc  = M_Tlsf_maxAlloc,
+)
+
+Arena Tlsf_asArena(Tlsf* d) { return (Arena) { .m = Tlsf_mArena(), .d = d }; }
+
+// #################################
+// # Buddy
+
+static void Buddy_push(Buddy* b, S i, U1 order) {
+  b->meta[i] = order | BUDDY_FREE;
+  DllRoot_add(&b->free[order], (Dll*)&b->blocks[i]);
+}
+
+void Buddy_init(Buddy* b, Block* blocks, U1* meta, S len) {
+  *b = (Buddy) { .blocks = blocks, .meta = meta, .len = len, .avail = len };
+  memset(meta, BUDDY_INTERIOR, len);
+  // Carve into the largest runs which are aligned (to their own size) and fit.
+  for(S i = 0; i < len; ) {
+    U1 o = 0;
+    while((o + 1 < BUDDY_ORDERS) and not (i & ((2 << o) - 1))
+          and (i + (2 << o) <= len)) o++;
+    Buddy_push(b, i, o);
+    i += 1 << o;
+  }
+}
+
+U1 Buddy_order(S sz) {
+  U1 o = 0;
+  while(o < BUDDY_ORDERS and ((S)BLOCK_SIZE << o) < sz) o++;
+  return o;
+}
+
+DEFINE_METHOD(void, Buddy,drop) {}
+
+DEFINE_METHOD(void*, Buddy,alloc, S sz, U2 alignment) {
+  ASSERT(alignment <= BLOCK_SIZE, "Buddy alloc: alignment > BLOCK_SIZE");
+  U1 o = Buddy_order(sz), j = o;
+  while(j < BUDDY_ORDERS and not this->free[j].start) j++;
+  if(j >= BUDDY_ORDERS) return NULL;
+  S i = (Block*)DllRoot_pop(&this->free[j]) - this->blocks;
+  while(j > o) { // split, freeing the upper halves
+    j -= 1;
+    Buddy_push(this, i + (1 << j), j);
+  }
+  this->meta[i] = o;
+  this->avail -= 1 << o;
+  return &this->blocks[i];
+}
+
+Slc Buddy_free_outside = SLC("Buddy free: outside of blocks");
+Slc Buddy_free_run     = SLC("Buddy free: not an allocated run");
+
+DEFINE_METHOD(Slc*, Buddy,free, void* data, S sz, U2 alignment) {
+  if(not data) return NULL;
+  Block* blk = data;
+  if(blk < this->blocks or blk >= this->blocks + this->len)
+    return &Buddy_free_outside;
+  S i = blk - this->blocks; U1 o = Buddy_order(sz);
+  if(((U1*)data - (U1*)this->blocks) % BLOCK_SIZE or this->meta[i] != o)
+    return &Buddy_free_run;
+  this->avail += 1 << o;
+  for(; o + 1 < BUDDY_ORDERS; o++) { // merge with free buddies
+    S bi = i ^ (1 << o);
+    if(bi + (1 << o) > this->len or this->meta[bi] != (o | BUDDY_FREE)) break;
+    DllRoot_remove(&this->free[o], (Dll*)&this->blocks[bi]);
+    this->meta[S_max(i, bi)] = BUDDY_INTERIOR;
+    i = S_min(i, bi);
+  }
+  Buddy_push(this, i, o);
+  return NULL;
+}
+
+// The largest run currently available.
+DEFINE_METHOD(S, Buddy,maxAlloc) {
+  for(int o = BUDDY_ORDERS - 1; o >= 0; o--) {
+    if(this->free[o].start) return (S)BLOCK_SIZE << o;
+  }
+  return 0;
+}
+
+DEFINE_METHODS(MArena, Buddy_mArena,
+  .drop      = M_Buddy_drop,
+  .free      = M_Buddy_free,
+  .alloc     = M_Buddy_alloc,
+  .maxAlloc  = M_Buddy_maxAlloc,
+)
+
+Arena Buddy_asArena(Buddy* d) { return (Arena) { .m = Buddy_mArena(), .d = d }; }
+
+// #################################
+// # ArenaStats
+
+static ArenaTag* ArenaStats_getTag(ArenaStats* s) {
+  if(not s->tag) return NULL;
+  for(U1 i = 0; i < ArenaStats_TAGS; i++) {
+    ArenaTag* t = &s->tags[i];
+    if(t->name == s->tag) return t;
+    if(not t->name) { t->name = s->tag; return t; }
+  }
+  return NULL; // table full
+}
+
+#define ArenaStats_GONE ((void*)1) // a removed tagged entry
+#define ArenaStats_PROBE(P) \
+  for(U2 i = ArenaStats_slot(P), n = 0; n < ArenaStats_LIVE;  \
+      n++, i = (i + 1) & (ArenaStats_LIVE - 1))
+
+static U2 ArenaStats_slot(void* p) {
+  return (U2)(((S)p >> 3) * 2654435761u) & (ArenaStats_LIVE - 1);
+}
+
+// Remember p's tag. Returns false if the table is full.
+static bool ArenaStats_track(ArenaStats* s, void* p, U1 tag) {
+  if(s->taggedLen >= ArenaStats_LIVE * 3 / 4) return false;
+  ArenaStats_PROBE(p) {
+    void* e = s->tagged[i].p;
+    if(e and e != ArenaStats_GONE) continue;
+    s->tagged[i].p = p; s->tagged[i].tag = tag; s->taggedLen += 1;
+    return true;
+  }
+  return false;
+}
+
+// Forget p, returning its tag (or NULL if it was not tracked).
+static ArenaTag* ArenaStats_untrack(ArenaStats* s, void* p) {
+  ArenaStats_PROBE(p) {
+    void* e = s->tagged[i].p;
+    if(not e) return NULL;
+    if(e != p) continue;
+    s->tagged[i].p = ArenaStats_GONE; s->taggedLen -= 1;
+    return &s->tags[s->tagged[i].tag];
+  }
+  return NULL;
+}
+
+DEFINE_METHOD(void, ArenaStats,drop) {
+  Xr(this->a,drop);
+  this->live = 0;
+  for(U1 i = 0; i < ArenaStats_TAGS; i++) this->tags[i].live = 0;
+  memset(this->tagged, 0, sizeof(this->tagged)); this->taggedLen = 0;
+}
+
+DEFINE_METHOD(void*, ArenaStats,alloc, S sz, U2 alignment) {
+  void* out = Xr(this->a,alloc, sz, alignment);
+  if(not out) { this->fails += 1; return NULL; }
+  this->allocs += 1;
+  this->live += sz; this->maxLive = S_max(this->maxLive, this->live);
+  U1 bin = 0; while(bin < ArenaStats_BINS - 1 and ((S)1 << bin) < sz) bin++;
+  this->hist[bin] += 1;
+  ArenaTag* t = ArenaStats_getTag(this);
+  if(t and ArenaStats_track(this, out, t - this->tags)) {
+    t->allocs += 1; t->live += sz; t->maxLive = S_max(t->maxLive, t->live);
+  }
+  return out;
+}
+
+DEFINE_METHOD(Slc*, ArenaStats,free, void* data, S sz, U2 alignment) {
+  Slc* err = Xr(this->a,free, data, sz, alignment);
+  if(err or not data) return err;
+  this->frees += 1; this->live -= sz;
+  ArenaTag* t = ArenaStats_untrack(this, data);
+  if(t) t->live -= sz;
+  return NULL;
+}
+
+DEFINE_METHOD(S, ArenaStats,maxAlloc) { return Xr(this->a,maxAlloc); }
+
+DEFINE_METHODS(MArena, ArenaStats_mArena,
+  .drop      = M_ArenaStats_drop,
+  .free      = M_ArenaStats_free,
+  .alloc     = M_ArenaStats_alloc,
+  .maxAlloc  = M_ArenaStats_maxAlloc,
+)
+
+Arena ArenaStats_asArena(ArenaStats* d) {
+  return (Arena) { .m = ArenaStats_mArena(), .d = d };
+}
+
+#define STATS_PRINT(...) do {                                      \
+    int n = snprintf(line, sizeof(line), __VA_ARGS__);              \
+    Writer_extend(w, (Slc){(U1*)line, S_min(n, sizeof(line) - 1)}); \
+  } while(0)
+
+void ArenaStats_dump(ArenaStats* s, Writer w) {
+  char line[128];
+  STATS_PRINT("arena: live=%zu max=%zu allocs=%u frees=%u fails=%u\n",
+              (size_t)s->live, (size_t)s->maxLive, s->allocs, s->frees, s->fails);
+  for(U1 i = 0; i < ArenaStats_BINS; i++) {
+    if(not s->hist[i]) continue;
+    if(i == ArenaStats_BINS - 1) STATS_PRINT("  sz>%-7u %u\n", 1 << (i - 1), s->hist[i]);
+    else                         STATS_PRINT("  sz<=%-6u %u\n", 1 << i, s->hist[i]);
+  }
+  for(U1 i = 0; i < ArenaStats_TAGS and s->tags[i].name; i++) {
+    ArenaTag* t = &s->tags[i];
+    STATS_PRINT("  [%.24s] live=%zu max=%zu allocs=%u\n",
+                t->name, (size_t)t->live, (size_t)t->maxLive, t->allocs);
+  }
+}
+
 // Write a Slc to a file.
 #define FEXTEND {                            \
   BaseFile* b = Xr(f, asBase);               \
@@ -630,19 +1720,23 @@ void File_extend  (File   f, Slc s) FEXTEND
 void Writer_extend(Writer f, Slc s) FEXTEND
 #undef FEXTEND
 
-void File_flush(File f) {
-  BaseFile* b = Xr(f, asBase);
-  do {
-    Xr(f,write);
-  } while(b->code < File_DONE);
+#define FFLUSH {                      \
+  BaseFile* b = Xr(f, asBase);        \
+  do {                                \
+    Xr(f,write);                      \
+  } while(b->code < File_DONE);       \
 }
 
+void File_flush  (File   f) FFLUSH
+void Writer_flush(Writer f) FFLUSH
+#undef FFLUSH
+
 
 // Read from file into Buf until Buf is full. Return the number of bytes read.
 #define FCONSUME {                                            \
   BaseFile* bf = Xr(f, asBase);                               \
   S read = 0;                                                 \
-  while((b->cap < b->len) and (bf->code < File_EOF)) {        \
+  while((b->len < b->cap) and (bf->code < File_EOF)) {        \
     Xr(f,read);                                               \
     read += Ring_consume(&bf->ring, b);                       \
   }                                                           \
@@ -735,6 +1829,319 @@ File BufFile_asFile(BufFile* d) {
   return (File) { .m = BufFile_mFile(), .d = d };
 }
 
+// #################################
+// # Lz
+#define LZ_NONE       0xFFFF
+#define LZ_HASH_LEN   (1 << LZ_HASH_BITS)
+
+static inline U2 lzHash(U1* p) {
+  U4 v = ((U4)p[0] << 16) | ((U4)p[1] << 8) | p[2];
+  return (U2)((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+LzWriter* LzWriter_init(LzWriter* z, Ring r, Writer dst, BA* ba) {
+  *z = (LzWriter) { .ring = r, .code = File_DONE, .dst = dst, .ba = ba };
+  z->win = BA_alloc(ba); z->hash = BA_alloc(ba);
+  if(not z->win or not z->hash) { LzWriter_drop(z); return NULL; }
+  memset(BANode_block(z->hash)->dat, 0xFF, LZ_HASH_LEN * sizeof(U2));
+  return z;
+}
+
+void LzWriter_drop(LzWriter* z) {
+  if(z->win)  BA_free(z->ba, z->win);
+  if(z->hash) BA_free(z->ba, z->hash);
+  z->win = NULL; z->hash = NULL;
+}
+
+// Emit win[lit:to] as literal tokens.
+static void lzEmitLiterals(LzWriter* z, U2 to) {
+  U1* w = BANode_block(z->win)->dat;
+  while(z->lit < to) {
+    U1 n = U4_min(to - z->lit, LZ_MAX_LIT);
+    U1 tok = n - 1;
+    Writer_extend(z->dst, (Slc){&tok, 1});
+    Writer_extend(z->dst, (Slc){w + z->lit, n});
+    z->lit += n;
+  }
+}
+
+// Drop the oldest data, keeping LZ_KEEP bytes of history.
+static void lzSlide(LzWriter* z) {
+  U1* w = BANode_block(z->win)->dat; U2* ht = (U2*)BANode_block(z->hash)->dat;
+  U2 shift = z->len - LZ_KEEP;
+  ASSERT(z->lit >= shift, "Lz: slide with pending literals");
+  memmove(w, w + shift, LZ_KEEP);
+  z->len -= shift; z->pos -= shift; z->lit -= shift;
+  for(U2 i = 0; i < LZ_HASH_LEN; i++) {
+    ht[i] = (ht[i] != LZ_NONE and ht[i] >= shift) ? ht[i] - shift : LZ_NONE;
+  }
+}
+
+// Compress starting at pos until pos reaches end. Matches may extend past end
+// (up to len).
+static void lzCompress(LzWriter* z, U2 end) {
+  U1* w = BANode_block(z->win)->dat; U2* ht = (U2*)BANode_block(z->hash)->dat;
+  U2 p = z->pos;
+  while(p + LZ_MIN_MATCH <= end) {
+    if(p - z->lit == LZ_MAX_LIT) lzEmitLiterals(z, p);
+    U2 h = lzHash(w + p);
+    U2 cand = ht[h]; ht[h] = p;
+    U2 mlen = 0;
+    if(cand != LZ_NONE) {
+      U2 max = U4_min(LZ_MAX_MATCH, z->len - p);
+      while(mlen < max and w[cand + mlen] == w[p + mlen]) mlen++;
+    }
+    if(mlen < LZ_MIN_MATCH) { p++; continue; }
+
+    lzEmitLiterals(z, p);
+    U1 tok[3] = { 0x80 | (mlen - LZ_MIN_MATCH) }; srBE2(tok + 1, p - cand);
+    Writer_extend(z->dst, (Slc){tok, 3});
+    // Index the inside of the match so later data can refer to it.
+    U2 mend = p + mlen;
+    for(p += 1; p < mend and p + LZ_MIN_MATCH <= z->len; p++) {
+      ht[lzHash(w + p)] = p;
+    }
+    p = mend; z->lit = p;
+  }
+  z->pos = p;
+}
+
+DEFINE_METHOD(BaseFile*, LzWriter,asBase) { return (BaseFile*) this; }
+
+DEFINE_METHOD(void, LzWriter,write) {
+  ASSERT(this->code == File_WRITING || this->code >= File_DONE, "write operation out of order");
+  this->code = File_WRITING;
+  Ring* r = &this->ring;
+  bool flush = Ring_isEmpty(r);
+  while(not Ring_isEmpty(r)) {
+    if(this->len == LZ_WIN) lzSlide(this);
+    Buf b = {
+      .dat = BANode_block(this->win)->dat, .len = this->len, .cap = LZ_WIN };
+    Ring_consume(r, &b); this->len = b.len;
+    if(this->len > LZ_MAX_MATCH) lzCompress(this, this->len - LZ_MAX_MATCH);
+  }
+  if(not flush) return;
+  lzCompress(this, this->len);
+  lzEmitLiterals(this, this->len); this->pos = this->len;
+  Writer_flush(this->dst);
+  this->code = File_DONE;
+}
+
+DEFINE_METHODS(MWriter, LzWriter_mWriter,
+  .asBase = M_LzWriter_asBase,
+  .write  = M_LzWriter_write,
+)
+
+LzReader* LzReader_init(LzReader* z, Ring r, Reader src, BA* ba) {
+  *z = (LzReader) { .ring = r, .code = File_DONE, .src = src, .ba = ba };
+  z->win = BA_alloc(ba);
+  return z->win ? z : NULL;
+}
+
+void LzReader_drop(LzReader* z) {
+  if(z->win) BA_free(z->ba, z->win);
+  z->win = NULL;
+}
+
+// Output one decompressed chunk to both the ring and the history.
+// s must not overlap the history it will be written to.
+static void lzOut(LzReader* z, Slc s) {
+  U1* w = BANode_block(z->win)->dat;
+  Ring_extend(&z->ring, s);
+  U2 first = U4_min(s.len, LZ_WIN - z->wpos);
+  memcpy(w + z->wpos, s.dat, first);
+  memcpy(w, s.dat + first, s.len - first);
+  z->wpos = (z->wpos + s.len) % LZ_WIN;
+  z->hist = U4_min(z->hist + s.len, LZ_WIN);
+}
+
+DEFINE_METHOD(BaseFile*, LzReader,asBase) { return (BaseFile*) this; }
+
+DEFINE_METHOD(void, LzReader,read) {
+  ASSERT(this->code == File_READING || this->code >= File_DONE, "read operation out of order");
+  ASSERT(this->code != File_EOF, "File read after EOF");
+  this->code = File_READING;
+  Ring* r = &this->ring; U1* w = BANode_block(this->win)->dat;
+  Ring* sr = &Xr(this->src,asBase)->ring;
+  while(not Ring_isFull(r)) {
+    if(this->mlen) {
+      // Copy the largest chunk which neither wraps nor overlaps its source.
+      U2 from = (this->wpos + LZ_WIN - this->moff) % LZ_WIN;
+      U2 n = U4_min(U4_min(this->mlen, Ring_remain(r)), LZ_WIN - from);
+      n = U4_min(n, U4_min(this->moff, LZ_WIN - this->moff));
+      lzOut(this, (Slc){w + from, n}); this->mlen -= n;
+      continue;
+    }
+    if(not Reader_get(this->src, 0)) { // src is at EOF (or error)
+      this->code = (this->lit or Xr(this->src,asBase)->code > File_EOF)
+                 ? File_ERROR : File_EOF;
+      return;
+    }
+    if(this->lit) {
+      Slc s = Ring_1st(sr);
+      s.len = U4_min(U4_min(s.len, this->lit), Ring_remain(r));
+      lzOut(this, s); Ring_incHead(sr, s.len); this->lit -= s.len;
+      continue;
+    }
+    U1 tok = Ring_pop(sr);
+    if(tok < 0x80) { this->lit = tok + 1; continue; }
+    U1* lo = Reader_get(this->src, 1);
+    if(not lo) { this->code = File_ERROR; return; }
+    U1 hi = Ring_pop(sr);
+    this->moff = (hi << 8) | Ring_pop(sr);
+    this->mlen = (tok & 0x7F) + LZ_MIN_MATCH;
+    // Corrupt input: the offset must be within the data decoded so far.
+    if(not this->moff or this->moff >= LZ_WIN or this->moff > this->hist) {
+      this->mlen = 0; this->code = File_ERROR; return;
+    }
+  }
+  this->code = File_DONE;
+}
+
+DEFINE_METHODS(MReader, LzReader_mReader,
+  .read   = M_LzReader_read,
+  .asBase = M_LzReader_asBase,
+)
+
+// #################################
+// # Crc32c
+#define CRC32C_POLY  0x82F63B78 // reflected
+
+static U4   crcTable[8][256];
+static bool crcTableInit = false;
+
+static void crc32cInitTable() {
+  for(U4 i = 0; i < 256; i++) {
+    U4 c = i;
+    for(U1 k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+    crcTable[0][i] = c;
+  }
+  for(U4 i = 0; i < 256; i++) {
+    U4 c = crcTable[0][i];
+    for(U1 t = 1; t < 8; t++) {
+      c = crcTable[0][c & 0xFF] ^ (c >> 8);
+      crcTable[t][i] = c;
+    }
+  }
+  crcTableInit = true;
+}
+
+static inline U4 ftLE4(U1* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((U4)p[3] << 24);
+}
+
+#define CRC_BYTE(C, B)  (crcTable[0][((C) ^ (B)) & 0xFF] ^ ((C) >> 8))
+
+U4 crc32cSoft(U4 crc, Slc s) {
+  if(not crcTableInit) crc32cInitTable();
+  U1* p = s.dat; U2 n = s.len; crc = ~crc;
+  for(; n and ((S)p & 7); n--) crc = CRC_BYTE(crc, *p++);
+  for(; n >= 8; n -= 8, p += 8) {
+    U4 lo = ftLE4(p) ^ crc; U4 hi = ftLE4(p + 4);
+    crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF]
+        ^ crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24]
+        ^ crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF]
+        ^ crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+  }
+  for(; n; n--) crc = CRC_BYTE(crc, *p++);
+  return ~crc;
+}
+#undef CRC_BYTE
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static U4 crc32cHw(U4 crc, Slc s) {
+  U1* p = s.dat; U2 n = s.len; crc = ~crc;
+  for(; n and ((S)p & (RSIZE - 1)); n--) crc = __builtin_ia32_crc32qi(crc, *p++);
+#if RSIZE == 8
+  U8 c = crc;
+  for(; n >= 8; n -= 8, p += 8) c = __builtin_ia32_crc32di(c, *(U8*)p);
+  crc = c;
+#else
+  for(; n >= 4; n -= 4, p += 4) crc = __builtin_ia32_crc32si(crc, *(U4*)p);
+#endif
+  for(; n; n--) crc = __builtin_ia32_crc32qi(crc, *p++);
+  return ~crc;
+}
+#endif
+
+U4 crc32c(U4 crc, Slc s) {
+#if defined(__i386__) || defined(__x86_64__)
+  static I1 hw = -1;
+  if(hw < 0) hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  if(hw) return crc32cHw(crc, s);
+#endif
+  return crc32cSoft(crc, s);
+}
+
+// Checksum the ring's data, skipping the first `skip` bytes.
+static U4 crcRing(U4 crc, Ring* r, U2 skip) {
+  Slc a = Ring_1st(r); Slc b = Ring_2nd(r);
+  if(skip >= a.len) { skip -= a.len; a.len = 0; }
+  else              { a.dat += skip; a.len -= skip; skip = 0; }
+  b.dat += skip; b.len -= skip;
+  return crc32c(crc32c(crc, a), b);
+}
+
+DEFINE_METHOD(BaseFile*, CrcWriter,asBase) { return Xr(this->dst,asBase); }
+DEFINE_METHOD(void, CrcWriter,write) {
+  Ring* r = &Xr(this->dst,asBase)->ring;
+  this->crc = crcRing(this->crc, r, this->seen);
+  Xr(this->dst,write);
+  this->seen = Ring_len(r);
+}
+
+DEFINE_METHODS(MWriter, CrcWriter_mWriter,
+  .asBase = M_CrcWriter_asBase,
+  .write  = M_CrcWriter_write,
+)
+
+DEFINE_METHOD(BaseFile*, CrcReader,asBase) { return Xr(this->src,asBase); }
+DEFINE_METHOD(void, CrcReader,read) {
+  Ring* r = &Xr(this->src,asBase)->ring;
+  U2 had = Ring_len(r);
+  Xr(this->src,read);
+  this->crc = crcRing(this->crc, r, had);
+}
+
+DEFINE_METHODS(MReader, CrcReader_mReader,
+  .read   = M_CrcReader_read,
+  .asBase = M_CrcReader_asBase,
+)
+
+// #################################
+// # TeeWriter
+DEFINE_METHOD(BaseFile*, TeeWriter,asBase) { return (BaseFile*) this; }
+
+DEFINE_METHOD(void, TeeWriter,write) {
+  ASSERT(this->code == File_WRITING || this->code >= File_DONE, "write operation out of order");
+  this->code = File_WRITING;
+  Ring* r = &this->ring;
+  U2 len = Ring_len(r), min = len;
+  for(U1 i = 0; i < this->len; i++) {
+    TeeSink* s = &this->sinks[i];
+    if(s->sent < len) {
+      BaseFile* b = Xr(s->f,asBase);
+      ASSERT(Ring_isEmpty(&b->ring), "TeeWriter: sink ring not empty");
+      Ring own = b->ring;
+      b->ring = *r; Ring_incHead(&b->ring, s->sent);
+      Xr(s->f,write);
+      s->sent = len - Ring_len(&b->ring);
+      b->ring = own;
+      if(b->code >= File_ERROR) { this->code = b->code; return; }
+    }
+    min = U4_min(min, s->sent);
+  }
+  Ring_incHead(r, min);
+  for(U1 i = 0; i < this->len; i++) this->sinks[i].sent -= min;
+  if(Ring_isEmpty(r)) this->code = File_DONE;
+}
+
+DEFINE_METHODS(MWriter, TeeWriter_mWriter,
+  .asBase = M_TeeWriter_asBase,
+  .write  = M_TeeWriter_write,
+)
+
 // #################################
 // # Fmt
 
@@ -833,3 +2240,405 @@ FileLogger* FileLogger_new(Arena a, File f) {
   return l;
 }
 
+// #################################
+// # LogQueue
+// Each record is a U4 header (len | COMMIT) followed by its bytes, padded to
+// 4. A record never wraps: a PAD record fills the end of dat instead. The
+// consumer zeroes what it consumed, so a header which is not yet committed
+// always reads as 0.
+
+#define LQ_COMMIT  0x80000000
+#define LQ_PAD     0x40000000
+#define LQ_LEN     0x3FFFFFFF
+#define LQ_HDR(Q, POS)  ((U4*)((Q)->dat + ((POS) & ((Q)->cap - 1))))
+
+void LogQueue_init(LogQueue* q, U1* dat, U4 cap, U1 policy) {
+  ASSERT(IS_PO2(cap) and not ((S)dat % 4), "LogQueue: bad buffer");
+  *q = (LogQueue) { .dat = dat, .cap = cap, .policy = policy };
+  memset(dat, 0, cap);
+}
+
+// Reserve space for a record of len bytes, returning its position.
+static bool LogQueue_reserve(LogQueue* q, U4 len, U4* pos) {
+  U4 need = 4 + align(len, 4);
+  U4 t = __atomic_load_n(&q->tail, __ATOMIC_RELAXED), pad;
+  do {
+    U4 off = t & (q->cap - 1);
+    pad = (off + need > q->cap) ? q->cap - off : 0;
+    U4 h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if(t + pad + need - h > q->cap) return false;
+  } while(not __atomic_compare_exchange_n(&q->tail, &t, t + pad + need, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  if(pad) __atomic_store_n(LQ_HDR(q, t), LQ_COMMIT | LQ_PAD | pad, __ATOMIC_RELEASE);
+  *pos = t + pad;
+  return true;
+}
+
+bool LogQueue_push(LogQueue* q, Slc* parts, U1 len) {
+  U4 total = 0; for(U1 i = 0; i < len; i++) total += parts[i].len;
+  ASSERT(4 + align(total, 4) <= q->cap / 2, "LogQueue_push: record too large");
+  U4 pos;
+  while(not LogQueue_reserve(q, total, &pos)) {
+    if(q->policy == LogQueue_DROP) {
+      __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    // A scheduled fiber must let the others (i.e. one draining) run.
+    if(civ.sched and (civ.fb != civ.sched->loop)) {
+      if(civ.sched->timers) Sched_sleep(LogQueue_WAIT_NS);
+      else                  Sched_yield();
+    } else if(civ.sleep) civ.sleep(LogQueue_WAIT_NS);
+  }
+  U1* dat = (U1*)LQ_HDR(q, pos) + 4;
+  for(U1 i = 0; i < len; i++) {
+    if(not parts[i].len) continue; // i.e. Ring_2nd's {NULL, 0}
+    memcpy(dat, parts[i].dat, parts[i].len); dat += parts[i].len;
+  }
+  __atomic_store_n(LQ_HDR(q, pos), LQ_COMMIT | total, __ATOMIC_RELEASE);
+  return true;
+}
+
+S LogQueue_drain(LogQueue* q, File f) {
+  U4 h = q->head; S records = 0;
+  while(true) {
+    U4* hdr = LQ_HDR(q, h);
+    U4 v = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+    if(not (v & LQ_COMMIT)) break;
+    U4 size = v & LQ_LEN;
+    if(not (v & LQ_PAD)) {
+      File_extend(f, (Slc) { .dat = (U1*)(hdr + 1), .len = size });
+      size = 4 + align(size, 4); records += 1;
+    }
+    memset(hdr, 0, size);
+    __atomic_store_n(&q->head, h += size, __ATOMIC_RELEASE);
+  }
+  if(records) File_flush(f);
+  return records;
+}
+
+// #################################
+// # QLogger
+
+// Push the record in the ring, ending it with a newline.
+static void QLogger_push(QLogger* l) {
+  Slc parts[3] = { Ring_1st(&l->ring), Ring_2nd(&l->ring), SLC("\n") };
+  LogQueue_push(l->q, parts, 3);
+  Ring_clear(&l->ring);
+}
+
+DEFINE_METHOD(bool, QLogger,drop, Arena a)    { return true; }
+DEFINE_METHOD(Sll*, QLogger,resourceLL)       { return this->sll; }
+DEFINE_METHOD(BaseFile*,  QLogger,asBase)     { return (BaseFile*) this; }
+DEFINE_METHOD(FmtState*,  QLogger,state)      { return &this->state; }
+DEFINE_METHOD(LogConfig*, QLogger,logConfig)  { return &this->config; }
+
+// Called when the ring is full (or flushed). Only complete records are
+// pushed, so a full ring truncates the record and drops the rest of it.
+DEFINE_METHOD(void, QLogger,write) {
+  this->code = File_DONE;
+  if(not this->started or not Ring_isFull(&this->ring)) return;
+  if(not this->truncated) QLogger_push(this);
+  this->truncated = true; Ring_clear(&this->ring);
+}
+
+DEFINE_METHOD(bool, QLogger,start, U1 lvl) {
+  if(not shouldLog(this->config.lvl, lvl)) return false;
+  ASSERT(not this->started, "Logger started twice");
+  this->started = true; this->truncated = false;
+  Ring_clear(&this->ring);
+  Writer w = QLogger_asWriter(this);
+  Writer_extend(w, SLC("["));
+  Writer_extend(w, logLvlMsg(lvl));
+  Writer_extend(w, SLC("] "));
+  return true;
+}
+
+DEFINE_METHOD(void, QLogger,add, Slc msg) {
+  Writer_extend(QLogger_asWriter(this), msg);
+}
+
+DEFINE_METHOD(void, QLogger,end) {
+  ASSERT(this->started, "Logger end without start");
+  if(not this->truncated) QLogger_push(this);
+  Ring_clear(&this->ring);
+  this->started = false;
+}
+
+DEFINE_METHODS(MLogger, QLogger_mLogger,
+  .r = (MResource) {
+    .drop = M_QLogger_drop,
+    .resourceLL = M_QLogger_resourceLL,
+  },
+  .fmt = (MFmt) {
+    .w = (MWriter) {
+      .asBase = M_QLogger_asBase,
+      .write = M_QLogger_write,
+    },
+    .state = M_QLogger_state,
+  },
+  .logConfig = M_QLogger_logConfig,
+  .start = M_QLogger_start,
+  .add   = M_QLogger_add,
+  .end   = M_QLogger_end,
+)
+
+QLogger QLogger_init(Ring r, LogQueue* q, U1 logCfg) {
+  return (QLogger) {
+    .ring = r, .code = File_DONE, .q = q,
+    .config = (LogConfig) { .lvl = logCfg },
+  };
+}
+
+// #################################
+// # BinLogger
+
+// A printf conversion: fmt[start] is the '%', fmt[mods] the length modifiers
+// (after flags, width and precision) and fmt[end - 1] the conversion.
+typedef struct { U2 start, mods, end; U1 conv; U1 arg; I4 prec; } BinSpec;
+
+#define BINSPEC_PREC_ARG  (-2) // '*'
+
+static U2 BinSpec_parse(Slc fmt, U2 i, BinSpec* sp) {
+  *sp = (BinSpec) { .start = i++, .prec = -1 };
+  #define C  ((i < fmt.len) ? fmt.dat[i] : 0)
+  if(C == '%') { sp->conv = '%'; sp->mods = sp->end = i + 1; return sp->end; }
+  while(C and strchr("-+ #0", C)) i++;
+  ASSERT(C != '*', "BinLog: '*' is only supported in %.*s");
+  while(C >= '0' and C <= '9')    i++;
+  if(C == '.') {
+    i++;
+    if(C == '*') { sp->prec = BINSPEC_PREC_ARG; i++; }
+    else for(sp->prec = 0; C >= '0' and C <= '9'; i++) sp->prec = sp->prec * 10 + C - '0';
+  }
+  sp->mods = i; U1 longs = 0, size = 4;
+  for(; C and strchr("hlzjt", C); i++) {
+    if(C == 'l')      longs += 1;
+    else if(C != 'h') size = sizeof(size_t);
+  }
+  if(longs) size = (longs == 1) ? sizeof(long) : 8;
+  sp->conv = C; sp->end = i + 1;
+  #undef C
+  switch(sp->conv) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      sp->arg = (size == 8) ? BinArg_U8 : BinArg_U4; break;
+    case 'p': sp->arg = (RSIZE == 8) ? BinArg_U8 : BinArg_U4; break;
+    case 'f': case 'e': case 'g': case 'E': case 'G': sp->arg = BinArg_F8; break;
+    case 's':
+      sp->arg = (sp->prec == BINSPEC_PREC_ARG) ? BinArg_SLC : BinArg_STR; break;
+    default: SET_ERR(SLC("BinLog: unsupported conversion"));
+  }
+  ASSERT(sp->prec != BINSPEC_PREC_ARG or sp->arg == BinArg_SLC,
+         "BinLog: '*' is only supported in %.*s");
+  return sp->end;
+}
+
+// Set f's args from its fmt.
+static void BinFmt_parse(BinFmt* f) {
+  Slc fmt = { .dat = (U1*)f->fmt, .len = strlen(f->fmt) }; BinSpec sp;
+  f->nargs = 0;
+  for(U2 i = 0; i < fmt.len; ) {
+    if(fmt.dat[i] != '%') { i++; continue; }
+    i = BinSpec_parse(fmt, i, &sp);
+    if(sp.conv == '%') continue;
+    ASSERT(f->nargs < BinLog_ARGS, "BinLog: too many arguments");
+    f->args[f->nargs++] = sp.arg;
+  }
+}
+
+static U2 binLogNextId = 1;
+
+#define BinFmt_BUSY 0xFFFF // id while a thread is registering it
+
+// Parse into a copy (so errors leave f untouched), then publish the args
+// before the id. Threads which lose the race wait for the winner.
+static U2 BinFmt_register(BinFmt* f) {
+  BinFmt parsed = { .fmt = f->fmt }; BinFmt_parse(&parsed);
+  U2 id = 0;
+  if(__atomic_compare_exchange_n(&f->id, &id, BinFmt_BUSY, false,
+                                 __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    id = __atomic_fetch_add(&binLogNextId, 1, __ATOMIC_RELAXED);
+    if(id >= BinLog_FMTS) {
+      __atomic_store_n(&f->id, 0, __ATOMIC_RELEASE);
+      SET_ERR(SLC("BinLog: too many formats"));
+    }
+    f->nargs = parsed.nargs; memcpy(f->args, parsed.args, sizeof(f->args));
+    __atomic_store_n(&f->id, id, __ATOMIC_RELEASE);
+    return id;
+  }
+  while(BinFmt_BUSY == id) id = __atomic_load_n(&f->id, __ATOMIC_ACQUIRE);
+  return id ? id : BinFmt_register(f); // the winner failed: retry
+}
+
+static void BinLogger_define(BinLogger* l, BinFmt* f) {
+  U2 zero = 0, len = strlen(f->fmt);
+  File_extend(l->f, (Slc) { (U1*)&zero,  2 });
+  File_extend(l->f, (Slc) { (U1*)&f->id, 2 });
+  File_extend(l->f, (Slc) { &f->lvl,     1 });
+  File_extend(l->f, (Slc) { (U1*)&len,   2 });
+  File_extend(l->f, (Slc) { (U1*)f->fmt, len });
+  l->defined[f->id / 8] |= 1 << (f->id % 8);
+}
+
+void BinLogger_log(BinLogger* l, BinFmt* f, ...) {
+  U2 id = __atomic_load_n(&f->id, __ATOMIC_ACQUIRE);
+  if(not id or (BinFmt_BUSY == id)) id = BinFmt_register(f);
+  if(not (l->defined[id / 8] & (1 << (id % 8)))) BinLogger_define(l, f);
+  U1 rec[BinLog_REC]; U2 len = 0;
+  #define PUT(PTR, N) do { memcpy(rec + len, PTR, N); len += (N); } while(0)
+  U8 time = civ.now ? civ.now() : 0;
+  PUT(&id, 2); PUT(&time, 8);
+  va_list ap; va_start(ap, f);
+  for(U1 i = 0; i < f->nargs; i++) {
+    switch(f->args[i]) {
+      case BinArg_U4: { U4 v = va_arg(ap, unsigned int);       PUT(&v, 4); break; }
+      case BinArg_U8: { U8 v = va_arg(ap, unsigned long long); PUT(&v, 8); break; }
+      case BinArg_F8: { double v = va_arg(ap, double);         PUT(&v, 8); break; }
+      case BinArg_STR: case BinArg_SLC: {
+        S n = (f->args[i] == BinArg_SLC) ? (S)va_arg(ap, int) : (S)-1;
+        const char* str = va_arg(ap, const char*);
+        if(n == (S)-1) n = strlen(str);
+        U2 n2 = S_min(n, BinLog_STR);
+        PUT(&n2, 2); PUT(str, n2);
+        break;
+      }
+    }
+  }
+  va_end(ap);
+  #undef PUT
+  File_extend(l->f, (Slc) { rec, len });
+}
+
+// #################################
+// # BinLogDec
+
+static bool BinLogDec_read(BinLogDec* d, void* dst, U2 n) {
+  BaseFile* b = Xr(d->src, asBase); Buf buf = { .dat = dst, .cap = n };
+  while(buf.len < n) {
+    if(not Reader_get(d->src, 0)) return false;
+    d->pos += Ring_consume(&b->ring, &buf);
+  }
+  return true;
+}
+
+#define DEC_READ(DST, N) \
+  ASSERT(BinLogDec_read(d, DST, N), "BinLogDec: truncated record")
+
+static void BinLogDec_define(BinLogDec* d) {
+  U2 id, len; U1 lvl;
+  DEC_READ(&id, 2); DEC_READ(&lvl, 1); DEC_READ(&len, 2);
+  ASSERT(id and (id < BinLog_FMTS), "BinLogDec: bad id");
+  BinFmt* f = Xr(d->a,alloc, sizeof(BinFmt), RSIZE);
+  U1* fmt   = Xr(d->a,alloc, len + 1, 1);
+  ASSERT(f and fmt, "BinLogDec: OOM");
+  DEC_READ(fmt, len); fmt[len] = 0;
+  *f = (BinFmt) { .fmt = (char*)fmt, .lvl = lvl, .id = id };
+  BinFmt_parse(f);
+  BinFmt*** page = &d->pages[id >> 8];
+  if(not *page) {
+    *page = Xr(d->a,alloc, 256 * sizeof(BinFmt*), RSIZE);
+    ASSERT(*page, "BinLogDec: OOM");
+    memset(*page, 0, 256 * sizeof(BinFmt*));
+  }
+  (*page)[id & 0xFF] = f;
+}
+
+// Format one argument of the spec to out.
+static void BinLogDec_arg(BinLogDec* d, Slc fmt, BinSpec* sp, Writer out) {
+  U1 spec[32], txt[BinLog_STR + 64]; U2 sl = 1; int n = 0;
+  spec[0] = '%';
+  // flags and width (and the precision, except for strings)
+  U2 upto = sp->mods;
+  if(sp->arg == BinArg_STR or sp->arg == BinArg_SLC) {
+    for(upto = sp->start + 1; upto < sp->mods and fmt.dat[upto] != '.'; upto++) {}
+  }
+  ASSERT(upto - sp->start + 4 < sizeof(spec), "BinLogDec: spec too long");
+  memcpy(spec + 1, fmt.dat + sp->start + 1, upto - sp->start - 1);
+  sl += upto - sp->start - 1;
+  U1 conv = (sp->conv == 'p') ? 'x' : sp->conv;
+  if(sp->conv == 'p') Writer_extend(out, SLC("0x"));
+  switch(sp->arg) {
+    case BinArg_U4: {
+      U4 v; DEC_READ(&v, 4);
+      for(U2 i = sp->mods; i < sp->end - 1; i++) { // keep only h modifiers
+        if(fmt.dat[i] == 'h') spec[sl++] = 'h';
+      }
+      spec[sl++] = conv; spec[sl] = 0;
+      n = snprintf(txt, sizeof(txt), spec, v);
+      break;
+    }
+    case BinArg_U8: {
+      U8 v; DEC_READ(&v, 8);
+      spec[sl++] = 'l'; spec[sl++] = 'l'; spec[sl++] = conv; spec[sl] = 0;
+      n = snprintf(txt, sizeof(txt), spec, (unsigned long long)v);
+      break;
+    }
+    case BinArg_F8: {
+      double v; DEC_READ(&v, 8);
+      spec[sl++] = conv; spec[sl] = 0;
+      n = snprintf(txt, sizeof(txt), spec, v);
+      break;
+    }
+    default: {
+      U2 len; U1 str[BinLog_STR]; DEC_READ(&len, 2);
+      ASSERT(len <= BinLog_STR, "BinLogDec: bad string");
+      DEC_READ(str, len);
+      if(sp->prec >= 0 and len > sp->prec) len = sp->prec;
+      memcpy(spec + sl, ".*s", 4);
+      n = snprintf(txt, sizeof(txt), spec, (int)len, str);
+    }
+  }
+  Writer_extend(out, (Slc) { txt, S_min(n, sizeof(txt) - 1) });
+}
+
+static bool BinLogDec_record(BinLogDec* d, Writer out) {
+  U2 id;
+  while(true) {
+    d->recPos = d->pos;
+    if(not BinLogDec_read(d, &id, 2)) {
+      ASSERT(d->pos == d->recPos, "BinLogDec: truncated record");
+      return false;
+    }
+    if(id) break;
+    BinLogDec_define(d);
+  }
+  BinFmt** page = d->pages[id >> 8];
+  BinFmt* f = page ? page[id & 0xFF] : NULL;
+  ASSERT(f, "BinLogDec: undefined id");
+  DEC_READ(&d->lastTime, 8);
+  if(d->time) {
+    U1 t[32];
+    int n = snprintf(t, sizeof(t), "%llu.%09llu ",
+      (unsigned long long)(d->lastTime / 1000000000),
+      (unsigned long long)(d->lastTime % 1000000000));
+    Writer_extend(out, (Slc) { t, n });
+  }
+  Writer_extend(out, SLC("["));
+  Writer_extend(out, logLvlMsg(f->lvl));
+  Writer_extend(out, SLC("] "));
+  Slc fmt = { .dat = (U1*)f->fmt, .len = strlen(f->fmt) };
+  U2 lit = 0; BinSpec sp;
+  for(U2 i = 0; i < fmt.len; ) {
+    if(fmt.dat[i] != '%') { i++; continue; }
+    Writer_extend(out, (Slc) { fmt.dat + lit, i - lit });
+    i = lit = BinSpec_parse(fmt, i, &sp);
+    if(sp.conv == '%') Writer_extend(out, SLC("%"));
+    else               BinLogDec_arg(d, fmt, &sp, out);
+  }
+  Writer_extend(out, (Slc) { fmt.dat + lit, fmt.len - lit });
+  Writer_extend(out, SLC("\n"));
+  return true;
+}
+
+// Corrupt input raises errors (the same checks as the encoder's): catch them
+// into d->err instead of failing the caller.
+bool BinLogDec_next(BinLogDec* d, Writer out) {
+  if(d->err.len) return false;
+  Fiber* fb = civ.fb; jmp_buf* prevJmp = fb->errJmp; U2 expect = fb->state & Fiber_EXPECT_ERR;
+  jmp_buf errJmp; fb->errJmp = &errJmp; fb->state |= Fiber_EXPECT_ERR;
+  bool more = false;
+  if(setjmp(errJmp)) { d->err = fb->err; fb->err = (Slc){0}; }
+  else more = BinLogDec_record(d, out);
+  fb->errJmp = prevJmp; fb->state = (fb->state & ~Fiber_EXPECT_ERR) | expect;
+  return more;
+}
+
@@ -107,6 +107,10 @@ void  Trace_free(Trace* t);
 void defaultErrPrinter();
 void runErrPrinter();
 
+// The current fiber (civ.fb), for the error macros. Not inline, so a fiber
+// which moved threads (see UPool) raises errors through its new thread's civ.
+struct _Fiber* Civ_fb();
+
 // Get the required addition/subtraction to ptr to achieve alignment
 S align(S ptr, U2 alignment);
 
@@ -158,7 +162,7 @@ void srBE(U1* p, S size, U4 value);
 static inline U4   U4_min (U4  a, U4  b) MIN_DEF
 static inline S    S_min(S a, S b) MIN_DEF
 
-#define MAX_DEF { if(a < b) return a; return b; }
+#define MAX_DEF { if(a < b) return b; return a; }
 static inline U4   U4_max (U4  a, U4  b) MAX_DEF
 static inline S S_max(S a, S b) MAX_DEF
 
@@ -399,6 +403,9 @@ void DllRoot_add(DllRoot* root, Dll* node);
 
 Dll* DllRoot_pop(DllRoot* root);
 
+// Remove node (which must be in root's chain).
+Dll* DllRoot_remove(DllRoot* root, Dll* node);
+
 // #################################
 // # Binary Search Tree
 typedef struct _Bst { struct _Bst* l; struct _Bst* r; } Bst;
@@ -454,12 +461,12 @@ CBst* CBst_add(CBst** root, CBst* add);
     }
 #define END_TEST  }
 
-#define ERR_EXPECTED  (Fiber_EXPECT_ERR & civ.fb->state)
+#define ERR_EXPECTED  (Fiber_EXPECT_ERR & Civ_fb()->state)
 
 #define SET_ERR(E)  if(true) { \
-  civ.fb->err = E; \
-  if(not ERR_EXPECTED) runErrPrinter(); \
-  longjmp(*civ.fb->errJmp, 1); }
+  Fiber* __errFb = Civ_fb(); __errFb->err = E; \
+  if(not (Fiber_EXPECT_ERR & __errFb->state)) runErrPrinter(); \
+  longjmp(*__errFb->errJmp, 1); }
 #define ASSERT(C, E)   do { if(!(C)) { SET_ERR(SLC(E)); } } while(0)
 #define ASSERT_NO_ERR()    assert(!civ.fb->err)
 
@@ -493,7 +500,7 @@ CBst* CBst_add(CBst** root, CBst* add);
   jmp_buf* LINED(prevJmp) = civ.fb->errJmp;                \
   jmp_buf LINED(newJmp); civ.fb->errJmp = &LINED(newJmp);  \
   if(setjmp(LINED(newJmp))) {             \
-    civ.fb->errJmp = LINED(prevJmp);      \
+    Civ_fb()->errJmp = LINED(prevJmp);    \
     HANDLE;                               \
   } else { CODE; }
 
@@ -560,23 +567,68 @@ void handleExpectedErr(Slc expect);
 
 // #################################
 // # BA: Block Allocator
+//
+// Each block has a BANode used to link it into the BA's free list (and by the
+// owner of the block, i.e. BBA) and to get the block (BANode_block).
+//
+// By default the BANodes are a separate array given to BA_freeArray. Compile
+// with -DBA_INTRUSIVE=1 to instead store the BANode at the end of its block:
+// this removes the parallel array and the node->block indirection at the cost
+// of 2*RSIZE bytes of BLOCK_AVAIL.
+#ifndef BA_INTRUSIVE
+#define BA_INTRUSIVE 0
+#endif
+
 #define BLOCK_PO2  12
 #define BLOCK_SIZE  (1<<BLOCK_PO2)
-#define BLOCK_AVAIL (BLOCK_SIZE - (sizeof(U2) * 2))
+#define BLOCK_NODE  (BA_INTRUSIVE ? 2 * RSIZE : 0) // bytes used by the node
+#define BLOCK_AVAIL (BLOCK_SIZE - (sizeof(U2) * 2) - BLOCK_NODE)
 #define BLOCK_END  0xFF
 
-typedef struct {
+typedef struct _BANode {
+  struct _BANode* next; struct _BANode* prev; // Dll
+#if !BA_INTRUSIVE
+  struct _Block* block;
+#endif
+} BANode;
+
+typedef struct _Block {
   U1 dat[BLOCK_AVAIL];
   U2 bot;
   U2 top;
+#if BA_INTRUSIVE
+  BANode node;
+#endif
 } Block;
 
-typedef struct _BANode {
-  struct _BANode* next; struct _BANode* prev; // Dll
-  Block* block;
-} BANode;
+#if BA_INTRUSIVE
+#define BANode_block(N) ((Block*)((U1*)(N) - offsetof(Block, node)))
+#define BA_NODES_SZ     0 // bytes of BANode array needed per block
+#else
+#define BANode_block(N) ((N)->block)
+#define BA_NODES_SZ     sizeof(BANode)
+#endif
+
+// Get the block containing ptr. Only valid for BLOCK_SIZE aligned blocks.
+#define Block_frPtr(PTR) ((Block*)((S)(PTR) & ~(S)(BLOCK_SIZE - 1)))
 
-typedef struct { BANode* free; S len; } BA;
+// The BA hands out single blocks from its free list. If the free list is
+// empty and grow is set, grow is called to add more blocks (i.e. by committing
+// reserved memory); it returns false if it could not.
+//
+// A BA is not thread safe. To allocate blocks from several threads, give each
+// thread a cache (see BA_cache) over one shared parent BA. A cache satisfies
+// alloc/free from its own free list and only takes the parent's lock to move
+// BA_BATCH blocks at a time. While caches are in use, the parent must only be
+// accessed while holding its lock (BA_lock).
+typedef struct _BA {
+  BANode* free; S len;
+  bool (*grow)(struct _BA* ba);
+  struct _BA* parent; // set for caches
+  U1 lock;            // spinlock, used when this is a parent
+} BA;
+
+#define BA_BATCH 32
 
 Dll*     BANode_asDll(BANode* node);
 DllRoot* BA_asDllRoot(BA* ba);
@@ -586,10 +638,29 @@ void BA_free(BA* ba, BANode* node);
 void BA_freeAll(BA* ba, BANode* nodes);
 
 // Free an array of nodes and blocks. Typically used to initialize BA.
+// With BA_INTRUSIVE nodes is ignored (and may be NULL).
 void BA_freeArray(BA* ba, S len, BANode nodes[], Block blocks[]);
 
+// A minimal spinlock on a byte (0 is unlocked).
+void Spin_lock(U1* lock);
+void Spin_unlock(U1* lock);
+
+void BA_lock(BA* ba);
+void BA_unlock(BA* ba);
+
+// Create a (typically thread-local) cache over parent.
+BA BA_cache(BA* parent);
+
+// Return all of the cache's blocks to its parent.
+void BA_dropCache(BA* cache);
+
 // #################################
 // # Arena Role
+// alignment must be a power of 2. 1 means unaligned, which some arenas (i.e.
+// BBA) allocate separately. Arenas support alignment up to at least RSIZE; BBA
+// and Buddy support up to BLOCK_SIZE. Tlsf supports any as long as sz +
+// alignment (plus a minimum chunk) fits in a pool, else alloc returns NULL.
+// free must be called with the same sz and alignment as alloc.
 typedef struct {
   void  (*drop)            (void* d);
   Slc*  (*free)            (void* d, void* dat, S sz, U2 alignment);
@@ -656,6 +727,9 @@ static inline Resource* Arena_asResource(Arena* a) { return (Resource*) a; }
 //
 // Fngi uses this allocator for "growing" the code heap. Therefore,
 // unaligned allocations always grow from top to bottom.
+//
+// Aligned allocations grow down from the top. Alignments above 4 (i.e. 64 for
+// a cache line) cost 2 extra bytes plus padding.
 
 typedef struct { BA* ba; BANode* dat; } BBA;
 #define BBA_new() (BBA) { .ba = &civ.ba }
@@ -664,7 +738,7 @@ S    BBA_used(BBA* b);
 
 DllRoot* BBA_asDllRoot(BBA* bba);
 Arena    BBA_asArena(BBA* b);
-#define  BBA_block(BBA) ((BBA)->dat->block)
+#define  BBA_block(BBA) BANode_block((BBA)->dat)
 
 DECLARE_METHOD(void, BBA,drop);   // BBA_drop
 DECLARE_METHOD(S , BBA,spare); // BBA_spare
@@ -676,14 +750,194 @@ DECLARE_METHOD(S , BBA,maxAlloc); // BBA_maxAlloc
 
 MArena* mBBAGet();
 
+// Grow the latest unaligned (ALIGN1) allocation from sz to newSz in place.
+// Returns false (doing nothing) if dat is not the latest allocation or the
+// block does not have room.
+bool BBA_grow(BBA* b, void* dat, S sz, S newSz);
+
+// Allocate sz bytes from the bottom (like ALIGN1, so BBA_grow works on it)
+// padded to alignment (at most RSIZE), storing the padding in *pad. Free it
+// with BBA_free(b, out - *pad, *pad + sz, 1).
+void* BBA_allocUp(BBA* b, S sz, U2 alignment, U1* pad);
+
+// A savepoint of a BBA. Resetting to it frees everything allocated since
+// BBA_mark in one call, in place of the individual (reverse order) frees.
+// Data allocated before the mark must not be freed until the reset.
+typedef struct { BANode* dat; U2 bot; U2 top; } BBAMark;
+
+BBAMark BBA_mark(BBA* b);
+void    BBA_reset(BBA* b, BBAMark m);
+
+// #################################
+// # Vec: growable array
+// A dynamic array of esz sized elements allocated from an arena, aligned to
+// the largest power of two dividing esz (at most RSIZE).
+// When full the storage is doubled: in place if the arena is a BBA and the
+// Vec is its latest allocation, else by copying to new storage (freeing the
+// old, which a BBA only does if it is the latest: otherwise it is reclaimed
+// when the BBA is reset or dropped).
+//
+//   Vec v = Vec_new(BBA_asArena(&bba), U4);
+//   Vec_push(&v, U4, 42);
+//   U4 x = Vec_get(&v, U4, 0);
+typedef struct {
+  U1* dat; S len; S cap; U2 esz;
+  U1 pad;   // BBA: alignment padding below dat (see BBA_allocUp)
+  Arena a;
+} Vec;
+
+#define Vec_new(ARENA, T)    ((Vec) { .esz = sizeof(T), .a = ARENA })
+#define Vec_get(V, T, I)     (((T*)(V)->dat)[I])
+#define Vec_last(V, T)       Vec_get(V, T, (V)->len - 1)
+#define Vec_pop(V, T)        Vec_get(V, T, --(V)->len)
+#define Vec_push(V, T, VAL)  do {                          \
+    T* _vecP = Vec_add(V); ASSERT(_vecP, "Vec_push OOM"); \
+    *_vecP = (VAL);                                       \
+  } while(0)
+
+// Ensure there is room for n more elements. Return false on OOM.
+bool  Vec_reserve(Vec* v, S n);
+// Add an element, returning it (uninitialized) or NULL on OOM.
+void* Vec_add(Vec* v);
+// Append n elements, return false on OOM.
+bool  Vec_extend(Vec* v, const void* dat, S n);
+void  Vec_drop(Vec* v);
+
+// #################################
+// # Slab: fixed-size slots
+// Carves blocks from a BA into slots of a single size, i.e. for Sll/Dll/CBst
+// nodes. Unlike BBA, alloc/free are O(1) in any order. Freed slots go on an
+// intrusive free list in their block and a block is returned to the BA as
+// soon as all of its slots are free.
+//
+// The blocks must be BLOCK_SIZE aligned: a slot finds its block's SlabHdr by
+// masking its address (Block_frPtr).
+typedef struct _Slab {
+  BA* ba;
+  BANode* partial;     // blocks with free slots (DllRoot)
+  BANode* full;        // blocks with no free slots (DllRoot)
+  U2 slotSz, slots;    // slot size and slots per block
+  U2 start;            // offset of the first slot
+} Slab;
+
+// Stored at the start of each of the Slab's blocks.
+typedef struct {
+  Slab* slab; BANode* node;
+  void* free;          // Sll of freed slots
+  U2 used, bump;       // used slots, next never-used slot
+} SlabHdr;
+
+Slab  Slab_new(BA* ba, U2 slotSz);
+Arena Slab_asArena(Slab* s);
+
+DECLARE_METHOD(void,  Slab,drop);
+DECLARE_METHOD(void*, Slab,alloc, S sz, U2 alignment);
+DECLARE_METHOD(Slc*,  Slab,free, void* data, S sz, U2 alignment);
+DECLARE_METHOD(S,     Slab,maxAlloc);
+
+// #################################
+// # Tlsf: Two-Level Segregated Fit
+// A general purpose arena: alloc/free of any size (up to Tlsf_MAX) in any
+// order, both O(1). Each BA block is a pool of chunks; free chunks are
+// coalesced with their physical neighbors and kept in size-class lists found
+// with two levels of bitmaps. A pool is returned to the BA once it is entirely
+// free, and Tlsf_drop frees all pools at once.
+//
+// Every chunk starts with a 4 byte TlsfHdr, so the payload (8 byte aligned)
+// is followed by the next chunk's header. Free chunks also store their list
+// links (TlsfLinks) in their payload.
+//
+// Like Slab, the blocks must be BLOCK_SIZE aligned.
+#define Tlsf_SL_BITS  2
+#define Tlsf_SL       (1 << Tlsf_SL_BITS)
+#define Tlsf_FL_MIN   4   // log2 of the smallest size class
+#define Tlsf_FL       (BLOCK_PO2 + 1 - Tlsf_FL_MIN)
+
+typedef struct { U2 prevSz; U2 sz; /*|Tlsf_FREE*/ } TlsfHdr;
+typedef struct { TlsfHdr* next; TlsfHdr* prev; } TlsfLinks;
+
+typedef struct _Tlsf {
+  BA* ba;
+  BANode* pools;                        // DllRoot
+  U2 flMap; U1 slMap[Tlsf_FL];          // non-empty lists
+  TlsfHdr* free[Tlsf_FL][Tlsf_SL];
+} Tlsf;
+
+// Stored at the start of each pool's block.
+typedef struct { Tlsf* tlsf; BANode* node; } TlsfPool;
+
+#define Tlsf_new(BA)  ((Tlsf) { .ba = BA })
+Arena Tlsf_asArena(Tlsf* t);
+
+DECLARE_METHOD(void,  Tlsf,drop);
+DECLARE_METHOD(void*, Tlsf,alloc, S sz, U2 alignment);
+DECLARE_METHOD(Slc*,  Tlsf,free, void* data, S sz, U2 alignment);
+DECLARE_METHOD(S,     Tlsf,maxAlloc);
+
+// #################################
+// # Buddy: power-of-two runs of blocks
+// Serves allocations larger than a block from a contiguous array of blocks.
+// An allocation of sz bytes takes a run of 2^order blocks (order = the
+// smallest with BLOCK_SIZE << order >= sz). Runs are split in halves to
+// allocate and merged with their free "buddy" half on free.
+//
+// meta[i] holds the order of the run starting at block i, or'd with BUDDY_FREE
+// if it is free. Free runs are kept in per-order lists stored in the run
+// itself. Blocks inside a free run (i.e. absorbed by a merge) are
+// BUDDY_INTERIOR, so freeing them (a double free) is rejected.
+//
+// Like BBA, free must use the exact same sz as alloc. Alignment is always
+// BLOCK_SIZE (relative to blocks) so it is ignored.
+#define BUDDY_ORDERS    16
+#define BUDDY_FREE      0x80
+#define BUDDY_INTERIOR  0x40
+
+typedef struct {
+  Block* blocks; U1* meta; S len; // len: number of blocks
+  S avail;                        // free blocks
+  DllRoot free[BUDDY_ORDERS];     // free runs by order
+} Buddy;
+
+// Initialize the buddy over blocks[len] using meta[len]
+void Buddy_init(Buddy* b, Block* blocks, U1* meta, S len);
+
+// The order needed for sz bytes (may be >= BUDDY_ORDERS)
+U1 Buddy_order(S sz);
+
+Arena Buddy_asArena(Buddy* b);
+
+DECLARE_METHOD(void,  Buddy,drop);
+DECLARE_METHOD(void*, Buddy,alloc, S sz, U2 alignment);
+DECLARE_METHOD(Slc*,  Buddy,free, void* data, S sz, U2 alignment);
+DECLARE_METHOD(S,     Buddy,maxAlloc);
+
 
 
 // #################################
 // # Civ Global Environment
 
 // fiberState bitfield
+#define Fiber_DONE         0x01 // fn returned (or errored)
+#define Fiber_ERR          0x02 // fn exited with an error (see err)
+#define Fiber_PARKED       0x04 // waiting for Sched_unpark
 #define Fiber_EXPECT_ERR   (0x80 /*disable error logging*/)
 
+// Context switching is hand written for x86/x86_64, else (or with
+// -DFIBER_ASM=0) uses ucontext.
+#ifndef FIBER_ASM
+#if defined(__i386__) || defined(__x86_64__)
+#define FIBER_ASM 1
+#else
+#define FIBER_ASM 0
+#endif
+#endif
+#if !FIBER_ASM
+#include <ucontext.h>
+#endif
+
+// A Fiber is a thread of execution with its own stack, which is suspended
+// and resumed cooperatively with Fiber_switch. A thread's initial Fiber (i.e.
+// from Fiber_init) runs on the thread's stack.
 typedef struct _Fiber {
   struct _Fiber* next;
   struct _Fiber* prev;
@@ -691,6 +945,16 @@ typedef struct _Fiber {
   U2 state;
   jmp_buf*   errJmp;
   Slc err;
+#if FIBER_ASM
+  void* sp;                // saved stack pointer while suspended
+#else
+  ucontext_t ctx;
+#endif
+  struct _Fiber* caller;   // the fiber which last switched to this one
+  void (*fn)(void* arg); void* arg;
+  U1* stack; S stackSz;
+  U8 ran;                  // run time under a Sched (civ.now units)
+  struct _Fiber* waiters;  // Sll (on next) of fibers joining this one
 } Fiber;
 
 // #################################
@@ -772,6 +1036,7 @@ void File_extend(File f, Slc s);
 void Writer_extend(Writer w, Slc s);
 
 void File_flush(File f);
+void Writer_flush(Writer w);
 
 
 S File_consume  (File   f, Buf* b);
@@ -794,6 +1059,7 @@ U1* Reader_get(Reader f, U2 i);
 
 #define File_ERROR    0xE0
 #define File_EIO      0xE2
+#define File_ETIMEDOUT 0xE3
 void File_panicOpen(void* d, Slc, S); // unsuported open
 void File_panic(void* d); // used to panic for unsported method
 void File_noop(void* d);  // used as noop for some file methods
@@ -851,6 +1117,197 @@ DECLARE_METHOD(BaseFile* , BufFile,asBase);
 DECLARE_METHOD(void      , BufFile,write);
 File BufFile_asFile(BufFile* d);
 
+// #################################
+// # Lz: streaming LZ77 compression
+// LzWriter compresses everything written to it into dst. LzReader decompresses
+// src as it is read. Both are wrapping roles: use them anywhere a Writer or
+// Reader is expected. Their working windows are blocks from a BA.
+//
+// The stream is a sequence of tokens:
+//   0x00-0x7F: literal run of (token + 1) bytes, which follow.
+//   0x80-0xFF: match of (token & 0x7F) + LZ_MIN_MATCH bytes, followed by a
+//              big endian U2 offset (1 to LZ_WIN-1) backwards into history.
+//
+// There is no header or end marker: the stream ends when src reaches EOF.
+//
+// LzWriter holds back up to LZ_MAX_MATCH bytes so that matches can span
+// writes. A write with an empty ring (i.e. Writer_flush) compresses everything.
+
+#define LZ_WIN        BLOCK_AVAIL // window (history + new data) size
+#define LZ_KEEP       2048        // history kept when the window slides
+#define LZ_MIN_MATCH  3
+#define LZ_MAX_MATCH  (0x7F + LZ_MIN_MATCH)
+#define LZ_MAX_LIT    0x80
+#define LZ_HASH_BITS  10
+
+typedef struct {
+  Ring     ring;   // uncompressed data written by the user
+  U2       code;
+  Writer   dst;    // compressed output
+  BA*      ba;
+  BANode*  win;    // window block: [history | uncompressed]
+  BANode*  hash;   // hash table block: U2 positions in win
+  U2       len;    // bytes in win
+  U2       pos;    // win[:pos] has been compressed
+  U2       lit;    // win[lit:pos] are literals not yet emitted
+} LzWriter;
+
+typedef struct {
+  Ring     ring;   // decompressed data for the user
+  U2       code;
+  Reader   src;    // compressed input
+  BA*      ba;
+  BANode*  win;    // circular history block
+  U2       wpos;   // next write position in win
+  U2       lit;    // remaining literal bytes in the current token
+  U2       mlen;   // remaining match bytes in the current token
+  U2       moff;   // offset of the current match
+  U2       hist;   // bytes decoded into win (up to LZ_WIN)
+} LzReader;
+
+// Initialize, allocating the windows from ba. Returns NULL on OOM.
+LzWriter* LzWriter_init(LzWriter* z, Ring r, Writer dst, BA* ba);
+LzReader* LzReader_init(LzReader* z, Ring r, Reader src, BA* ba);
+
+// Return the windows to the BA. Does not flush.
+void LzWriter_drop(LzWriter* z);
+void LzReader_drop(LzReader* z);
+
+MWriter* LzWriter_mWriter();
+MReader* LzReader_mReader();
+
+DECLARE_METHOD(BaseFile* , LzWriter,asBase);
+DECLARE_METHOD(void      , LzWriter,write);
+DECLARE_METHOD(BaseFile* , LzReader,asBase);
+DECLARE_METHOD(void      , LzReader,read);
+
+static inline Writer LzWriter_asWriter(LzWriter* z) {
+  return (Writer) { .m = LzWriter_mWriter(), .d = z };
+}
+static inline Reader LzReader_asReader(LzReader* z) {
+  return (Reader) { .m = LzReader_mReader(), .d = z };
+}
+
+// #################################
+// # Crc32c: CRC-32C (Castagnoli) checksum
+// Continue crc (start with 0) over s. crc32c uses the SSE4.2 crc32 instruction
+// when the CPU supports it, else the slicing-by-8 tables of crc32cSoft.
+U4 crc32c    (U4 crc, Slc s);
+U4 crc32cSoft(U4 crc, Slc s);
+
+// CrcWriter and CrcReader are pass-through roles: they share the wrapped
+// file's ring (so there is no copy) and update crc as bytes flow through it.
+// CrcWriter checksums data as it is written to dst, CrcReader as it is read
+// from src.
+typedef struct {
+  Writer dst;
+  U4     crc;
+  U2     seen;  // bytes at the head of dst's ring which are already in crc
+} CrcWriter;
+
+typedef struct { Reader src; U4 crc; } CrcReader;
+
+MWriter* CrcWriter_mWriter();
+MReader* CrcReader_mReader();
+
+DECLARE_METHOD(BaseFile* , CrcWriter,asBase);
+DECLARE_METHOD(void      , CrcWriter,write);
+DECLARE_METHOD(BaseFile* , CrcReader,asBase);
+DECLARE_METHOD(void      , CrcReader,read);
+
+static inline CrcWriter CrcWriter_init(Writer dst) {
+  return (CrcWriter) { .dst = dst, .seen = Ring_len(&Xr(dst,asBase)->ring) };
+}
+static inline CrcReader CrcReader_init(Reader src) {
+  return (CrcReader) { .src = src };
+}
+static inline Writer CrcWriter_asWriter(CrcWriter* c) {
+  return (Writer) { .m = CrcWriter_mWriter(), .d = c };
+}
+static inline Reader CrcReader_asReader(CrcReader* c) {
+  return (Reader) { .m = CrcReader_mReader(), .d = c };
+}
+
+// #################################
+// # TeeWriter: write one ring to several Files
+// Data is written once to the tee's ring. On write, each sink writes straight
+// from that ring: the sink's own ring is temporarily replaced with a view of
+// the tee's ring, so no per-sink copy is made. The head only advances past
+// data every sink has written.
+//
+// Sinks must be dedicated to the tee while it is in use and have empty rings.
+// If a sink errors, the tee's code is set to the sink's error code.
+
+typedef struct {
+  File f;
+  U2   sent; // bytes past the tee's head this sink has written
+} TeeSink;
+
+typedef struct {
+  Ring     ring;
+  U2       code;
+  TeeSink* sinks;
+  U1       len;
+} TeeWriter;
+
+MWriter* TeeWriter_mWriter();
+DECLARE_METHOD(BaseFile* , TeeWriter,asBase);
+DECLARE_METHOD(void      , TeeWriter,write);
+
+static inline TeeWriter TeeWriter_init(Ring r, TeeSink* sinks, U1 len) {
+  return (TeeWriter) { .ring = r, .code = File_DONE, .sinks = sinks, .len = len };
+}
+static inline Writer TeeWriter_asWriter(TeeWriter* t) {
+  return (Writer) { .m = TeeWriter_mWriter(), .d = t };
+}
+
+// #################################
+// # ArenaStats: instrumented Arena
+// Wraps any arena, forwarding every call while counting live bytes,
+// allocations and a histogram of allocation sizes, along with high-water
+// marks. Use it to right-size block pools:
+//
+//   ArenaStats st = ArenaStats_new(BBA_asArena(&bba));
+//   Arena a = ArenaStats_asArena(&st);
+//   ArenaStats_tag(&st, "parser"); ... use a ...
+//   ArenaStats_dump(&st, File_asWriter(civ.logFile));
+//
+// Tagged allocations are also counted under their tag (compared by pointer,
+// so use string literals). A side table remembers the tag of each live tagged
+// allocation, so a free is counted under the tag it was allocated with. When
+// the table is full (ArenaStats_LIVE), allocations are not counted by tag.
+#define ArenaStats_BINS  16   // hist[i]: sz in (2^(i-1), 2^i], the last is larger
+#define ArenaStats_TAGS  8
+#define ArenaStats_LIVE  128  // tracked live tagged allocations (power of 2)
+
+typedef struct {
+  const char* name;
+  S live, maxLive; U4 allocs;
+} ArenaTag;
+
+typedef struct {
+  Arena a;                     // wrapped arena
+  S live, maxLive;             // bytes
+  U4 allocs, frees, fails;
+  U4 hist[ArenaStats_BINS];
+  const char* tag;             // current tag (NULL=none)
+  ArenaTag tags[ArenaStats_TAGS];
+  struct { void* p; U1 tag; } tagged[ArenaStats_LIVE]; // open addressing
+  U2 taggedLen;
+} ArenaStats;
+
+#define ArenaStats_new(ARENA) ((ArenaStats) { .a = ARENA })
+static inline void ArenaStats_tag(ArenaStats* s, const char* tag) { s->tag = tag; }
+Arena ArenaStats_asArena(ArenaStats* s);
+
+// Write a human readable report.
+void ArenaStats_dump(ArenaStats* s, Writer w);
+
+DECLARE_METHOD(void,  ArenaStats,drop);
+DECLARE_METHOD(void*, ArenaStats,alloc, S sz, U2 alignment);
+DECLARE_METHOD(Slc*,  ArenaStats,free, void* data, S sz, U2 alignment);
+DECLARE_METHOD(S,     ArenaStats,maxAlloc);
+
 // #################################
 // # Logger
 // Role. Example file-based logger is in civ_unix.
@@ -956,12 +1413,162 @@ static inline Writer FileLogger_asWriter(FileLogger* f) {
   return (Writer) { .m = &FileLogger_mLogger()->fmt.w, .d = f };
 }
 
+// #################################
+// # LogQueue + QLogger: asynchronous logging
+// A LogQueue is a bounded, lock-free, multi-producer single-consumer queue of
+// log records (byte strings). Producers reserve space with a CAS on tail,
+// copy their record in and then commit it by setting its header. The consumer
+// (LogQueue_drain, i.e. from a background thread or an idle fiber) copies
+// committed records to a File in order, flushing once per batch, so the
+// logging thread never waits on write().
+//
+// When full, push either drops the record (counting it in dropped) or waits
+// for the consumer depending on policy. A scheduled fiber waits with
+// Sched_sleep (Sched_yield without timers) so a draining fiber on the same
+// Sched can run, anything else with civ.sleep.
+//
+// A QLogger is a Logger which builds each record in its own Ring and pushes
+// it to a LogQueue at end. Use one QLogger per thread (they can share a
+// LogQueue). A record longer than the Ring is truncated (ending with "\n").
+#define LogQueue_DROP   0
+#define LogQueue_BLOCK  1
+#define LogQueue_WAIT_NS 100000 // BLOCK: wait between retries
+
+typedef struct {
+  U1* dat; U4 cap;   // cap is a power of 2, dat is 4 byte aligned
+  U4 head;           // consumed (bytes, wrapping)
+  U4 tail;           // reserved by producers
+  U1 policy;         // LogQueue_(DROP|BLOCK)
+  S dropped;         // records dropped
+} LogQueue;
+
+// dat[cap] is cleared. Records must be at most cap/2 - 4 bytes.
+void LogQueue_init(LogQueue* q, U1* dat, U4 cap, U1 policy);
+
+// Push one record, the concatenation of parts. Any thread.
+// Returns false if it was dropped.
+bool LogQueue_push(LogQueue* q, Slc* parts, U1 len);
+
+// Copy all committed records to f and flush it. Only one consumer at a time.
+// Returns the number of records.
+S    LogQueue_drain(LogQueue* q, File f);
+
+typedef struct {
+  Ring ring; U2 code;  // BaseFile: the record being built
+  Sll* sll;
+  LogQueue* q;
+  FmtState state;
+  LogConfig config;
+  bool started; bool truncated;
+} QLogger;
+MLogger* QLogger_mLogger();
+
+DECLARE_METHOD(bool       , QLogger,drop, Arena a);
+DECLARE_METHOD(Sll*       , QLogger,resourceLL);
+DECLARE_METHOD(FmtState*  , QLogger,state);
+DECLARE_METHOD(BaseFile*  , QLogger,asBase);
+DECLARE_METHOD(void       , QLogger,write);
+DECLARE_METHOD(LogConfig* , QLogger,logConfig);
+DECLARE_METHOD(bool       , QLogger,start, U1 lvl);
+DECLARE_METHOD(void       , QLogger,add, Slc msg);
+DECLARE_METHOD(void       , QLogger,end);
+
+QLogger QLogger_init(Ring r, LogQueue* q, U1 logCfg);
+
+static inline Logger QLogger_asLogger(QLogger* l) {
+  return (Logger) { .m = QLogger_mLogger(), .d = l };
+}
+static inline Writer QLogger_asWriter(QLogger* l) {
+  return (Writer) { .m = &QLogger_mLogger()->fmt.w, .d = l };
+}
+
+// #################################
+// # BinLogger: binary logging with deferred formatting
+// Each call site has a static BinFmt (a printf format and level) which gets a
+// process wide id the first time it is used. A record stores only the id, a
+// timestamp (civ.now) and the raw argument bytes, so logging does no text
+// formatting. The first record of an id in a stream is preceded by the
+// format's definition, so the stream is self describing: BinLogDec (and the
+// blogdec tool) turn it back into the text lines FileLogger would write.
+//
+//   BinLogger l = BinLogger_init(f, LOG_SET_INFO);
+//   BLOG(&l, LOG_INFO, "read %u bytes from %.*s", n, Dat_fmt(path));
+//
+// Supported conversions: d i u x X o c (with h, l, ll, z, j, t), f e g, p,
+// s and .*s (strings are stored up to BinLog_STR bytes). The stream uses the
+// host's byte order.
+//
+// Stream: records start with a U2 id. Id 0 is a definition:
+//   U2 0, U2 id, U1 lvl, U2 len, fmt[len]
+// else the record is the id's data:
+//   U2 id, U8 time, args (U4, U8, F8 or U2 len + bytes for strings)
+#define BinLog_FMTS  4096 // max ids
+#define BinLog_ARGS  8    // max arguments of a format
+#define BinLog_STR   255  // max bytes stored of a string argument
+#define BinLog_REC   (10 + BinLog_ARGS * (2 + BinLog_STR)) // max record bytes
+
+#define BinArg_U4   1
+#define BinArg_U8   2
+#define BinArg_F8   3
+#define BinArg_STR  4 // %s: a nul terminated string
+#define BinArg_SLC  5 // %.*s: int len, then the data
+
+typedef struct {
+  const char* fmt; U1 lvl;
+  U2 id;                       // 0 until registered
+  U1 nargs; U1 args[BinLog_ARGS];
+} BinFmt;
+
+typedef struct {
+  File f;                      // the binary stream
+  LogConfig config;
+  U1 defined[BinLog_FMTS / 8]; // ids whose definition is in the stream
+} BinLogger;
+
+static inline BinLogger BinLogger_init(File f, U1 logCfg) {
+  return (BinLogger) { .f = f, .config = (LogConfig) { .lvl = logCfg } };
+}
+
+// Use BLOG instead.
+void BinLogger_log(BinLogger* l, BinFmt* fmt, ...);
+
+#define BLOG(L, LVL, FMT, ...) do {                                  \
+    static BinFmt LINED(_binFmt) = { .fmt = FMT, .lvl = LVL };       \
+    if(shouldLog((L)->config.lvl, LVL))                              \
+      BinLogger_log(L, &LINED(_binFmt) __VA_OPT__(,) __VA_ARGS__);   \
+  } while(0)
+
+// Decoder of a binary log stream.
+typedef struct {
+  Reader src;
+  Arena a;                     // for the formats
+  BinFmt** pages[BinLog_FMTS / 256]; // formats by id
+  bool time;                   // prefix lines with the time in seconds
+  U8 lastTime;                 // of the last record
+  S pos;                       // bytes read from src
+  S recPos;                    // where the current record started
+  Slc err;                     // why decoding stopped (len 0 at the end)
+} BinLogDec;
+
+static inline BinLogDec BinLogDec_init(Reader src, Arena a) {
+  return (BinLogDec) { .src = src, .a = a };
+}
+
+// Decode the next data record (and any definitions before it) as a line of
+// text to out. Returns false at the end of the stream, or if it is corrupt
+// (i.e. truncated, an undefined id or a bad format), setting err: the record
+// at recPos may then be partially written.
+bool BinLogDec_next(BinLogDec* d, Writer out);
+
 // #################################
 // # Global Civ struct
 
 typedef struct {
   BA         ba;    // root block allocator
   Fiber*     fb;    // currently executing fiber
+  struct _Sched* sched; // scheduler running fb (if any)
+  U8 (*now)();      // monotonic clock, i.e. nanoseconds (NULL: none)
+  void (*sleep)(U8 ns); // block the thread for ns (NULL: spin)
   U1 logLvl;
 
   File logFile;  File outFile;
@@ -972,14 +1579,206 @@ typedef struct {
 } Civ;
 
 extern char**     ARGV;
-extern Civ        civ;
+extern _Thread_local Civ civ; // each thread has its own
 
 void Civ_init(Fiber* fb, U1 logLvl);
 
+// Threads: every thread has its own civ (and therefore its own current fiber
+// and errJmp), but blocks come from one shared BA. Before starting threads,
+// the spawning thread calls Civ_share, which moves civ.ba to shared and
+// replaces it with a BA_cache over it. Existing users of &civ.ba (i.e. BBAs)
+// keep working through the cache.
+//
+// Each new thread then calls Civ_initThread with a copy of the spawning
+// thread's civ (logLvl, now, logFile, errPrinter, etc are inherited) and
+// Civ_dropThread before it exits, returning its cached blocks.
+void Civ_share(BA* shared);
+void Civ_unshare(BA* shared); // all threads must have dropped
+void Civ_initThread(Fiber* fb, Civ* from, BA* shared);
+void Civ_dropThread();
+
 static inline void Fiber_init(Fiber* fb, jmp_buf* errJmp) {
   *fb = (Fiber) {
     .errJmp = errJmp,
   };
 }
 
+// Prepare fb to run fn(arg) on stack[stackSz] once it is switched to. When fn
+// returns (or errors, which is caught and stored in fb->err) the fiber is
+// DONE and switches back to its caller.
+void Fiber_new(Fiber* fb, U1* stack, S stackSz, void (*fn)(void* arg), void* arg);
+
+// Fiber_new with a stack (aligned to 16) allocated from the arena (i.e. a BBA
+// for small stacks or a Buddy for multi-block ones). Returns false on OOM.
+bool Fiber_alloc(Fiber* fb, Arena a, S stackSz, void (*fn)(void*), void* arg);
+void Fiber_free(Fiber* fb, Arena a);
+
+// Suspend the current fiber (civ.fb) and resume `to`, which becomes civ.fb.
+// Returns when another fiber switches back to this one.
+void Fiber_switch(Fiber* to);
+
+// #################################
+// # TimerWheel: hierarchical timer wheel
+// Timers are kept in TIMER_LEVELS wheels of TIMER_SLOTS slots. Level 0 has a
+// slot per tick and each slot of level n spans TIMER_SLOTS^n ticks. Adding and
+// cancelling are O(1). When level 0 wraps, the next level's current slot is
+// cascaded down. Timers further out than the last level wait in its furthest
+// slot and are placed again when it is cascaded.
+//
+// Times are in nanoseconds of a monotonic clock (i.e. civ.now). A timer fires
+// (calls t->fn(t)) at the first TimerWheel_advance whose tick is >= its time.
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_SPAN   ((U8)1 << (TIMER_BITS * TIMER_LEVELS)) // ticks covered
+
+typedef struct _Timer {
+  struct _Timer* next; struct _Timer* prev;
+  struct _Timer** slot;    // slot list it is in, NULL when not pending
+  U8 at;                   // expiry (ticks)
+  void (*fn)(struct _Timer* t); void* arg;
+} Timer;
+
+typedef struct {
+  U8 tick;                 // current tick, timers up to it have fired
+  U8 tickNs;               // nanoseconds per tick
+  S len;                   // pending timers
+  Timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+void TimerWheel_init(TimerWheel* w, U8 tickNs, U8 now);
+void TimerWheel_add(TimerWheel* w, Timer* t, U8 at);
+void TimerWheel_cancel(TimerWheel* w, Timer* t); // does nothing if not pending
+static inline bool Timer_pending(Timer* t) { return t->slot; }
+
+// Fire all timers up to now. Returns the number fired.
+S    TimerWheel_advance(TimerWheel* w, U8 now);
+
+// The earliest time (ns) at which a timer may fire, or U8 max if none are
+// pending. May be earlier than the real next expiry (a cascade).
+U8   TimerWheel_next(TimerWheel* w);
+
+// #################################
+// # Sched: cooperative Fiber scheduler
+// Multiplexes fibers on one thread. Runnable fibers are kept in a FIFO on
+// their next/prev links. Sched_run switches to each in turn (adding the time
+// until it switches back to its `ran`) until none are runnable.
+//
+// From inside a scheduled fiber:
+// * Sched_yield: go to the back of the queue.
+// * Sched_park: suspend until another fiber calls Sched_unpark on it.
+// * Sched_join: park until the given fiber is DONE.
+// * Sched_sleep/Sched_parkUntil: park with a timeout (requires timers).
+//
+// Unparking a fiber which is not parked does nothing, so a fiber may be woken
+// by several sources (i.e. a timeout and a channel) at once.
+//
+// With timers set, Sched_run also advances them (using civ.now) and, when no
+// fiber is runnable, waits (civ.sleep) for the next one.
+//
+// With poll set (i.e. UPoller), fibers can also park waiting for I/O (counted
+// in ioWaits). When no fiber is runnable Sched_run blocks in poll, else it
+// polls without blocking every SCHED_POLL_EVERY switches.
+#define SCHED_POLL_EVERY 32
+
+typedef struct _Sched {
+  Fiber* head; Fiber* tail;  // ready queue
+  Fiber* loop;               // the fiber running Sched_run
+  S live;                    // spawned fibers which are not DONE
+  TimerWheel* timers;        // (optional)
+  // (optional) wait up to ns (0: don't block, U8 max: forever) for I/O,
+  // unparking the fibers which are ready.
+  void (*poll)(struct _Sched* s, U8 ns); void* poller;
+  S ioWaits; S switches;
+} Sched;
+
+static inline void Sched_init(Sched* s) { *s = (Sched) {0}; }
+
+// Add a new fiber (see Fiber_new) to the ready queue.
+void Sched_spawn(Sched* s, Fiber* fb);
+
+// Run until no fiber is runnable. Returns the number of fibers still live
+// (parked forever) which is 0 unless they deadlocked.
+S    Sched_run(Sched* s);
+
+void Sched_yield();
+void Sched_park();
+void Sched_unpark(Fiber* fb);
+void Sched_join(Fiber* fb);
+
+// Park until unparked or `at` (civ.now time). Returns true if it timed out.
+bool Sched_parkUntil(U8 at);
+void Sched_sleep(U8 ns);
+
+// #################################
+// # Chan: bounded channels between Sched fibers
+// A send to a full channel parks the sending fiber until a receiver makes
+// room, and a receive from an empty channel parks until a sender adds data,
+// so pipeline stages flow-control each other without polling. Waiting
+// requires a Sched (see Sched_park).
+//
+// Chan is a stream of bytes over a Ring. PtrChan is a queue of (non-NULL)
+// pointers. Both can be closed: sends (including parked ones) then return
+// false and receives drain what is left, then return 0/NULL.
+//
+//   p = PtrChan_recv(&in);  // parks until a value is available
+//   PtrChan_send(&out, p);  // parks while out is full
+#define Chan_RECV 0
+#define Chan_SEND 1
+
+typedef struct { Fiber* fb; bool woken; } ChanSel; // a parked fiber
+typedef struct _ChanWait { struct _ChanWait* next; ChanSel* sel; } ChanWait;
+typedef struct { ChanWait* recvs; ChanWait* sends; bool closed; } ChanWaiters;
+
+typedef struct { Ring ring; ChanWaiters w; } Chan;
+typedef struct { void** buf; U2 head; U2 len; U2 cap; ChanWaiters w; } PtrChan;
+
+static inline Chan Chan_init(Ring r) { return (Chan) { .ring = r }; }
+
+// Send all of s, parking whenever the Ring is full. Returns false if c is
+// (or becomes) closed, in which case only part of s may have been sent.
+bool Chan_send(Chan* c, Slc s);
+
+// Park until there is data (or c is closed), then move as much as fits into b.
+// Returns the amount moved: 0 once c is closed and empty.
+U2   Chan_recv(Chan* c, Buf* b);
+void Chan_close(Chan* c);
+
+static inline PtrChan PtrChan_init(void** buf, U2 cap) {
+  return (PtrChan) { .buf = buf, .cap = cap };
+}
+bool  PtrChan_send(PtrChan* c, void* p); // false if c is (or becomes) closed
+void* PtrChan_recv(PtrChan* c); // NULL once c is closed and empty
+void  PtrChan_close(PtrChan* c);
+
+// Non-blocking versions. trySend returns false if full or closed.
+bool  PtrChan_trySend(PtrChan* c, void* p);
+void* PtrChan_tryRecv(PtrChan* c); // NULL if empty
+
+// A select case: op is Chan_SEND (of p) or Chan_RECV (into p).
+#define Chan_SELECT_MAX 16
+typedef struct { PtrChan* ch; U1 op; void* p; } ChanCase;
+
+// Park until one of the cases can proceed, perform it and return its index.
+// Cases are tried in order. A RECV from a closed and empty channel, or a SEND
+// to a closed channel (which sends nothing), proceeds with p = NULL.
+U2 PtrChan_select(ChanCase* cases, U2 len);
+
+// #################################
+// # Deque: Chase-Lev work-stealing deque of Fibers
+// The owning thread pushes and pops at the bottom (LIFO), any other thread
+// may steal from the top (FIFO). Lock free, with a fixed power-of-2 capacity.
+typedef struct {
+  ISlot top, bottom;
+  Fiber** buf; S mask;       // mask = cap - 1
+} Deque;
+
+static inline Deque Deque_init(Fiber** buf, S cap) {
+  return (Deque) { .buf = buf, .mask = cap - 1 };
+}
+
+bool   Deque_push(Deque* d, Fiber* fb); // owner. false if full
+Fiber* Deque_pop(Deque* d);             // owner
+Fiber* Deque_steal(Deque* d);           // any thread. NULL if empty or lost
+
 #endif // __CIV_H
@@ -1,8 +1,15 @@
-#include <unistd.h> // read, write, lseek
+#include <unistd.h> // read, write, lseek, pipe
+#include <spawn.h>  // posix_spawnp
+#include <sys/wait.h>
+#include <sys/mman.h> // mmap, mprotect, madvise
+#include <sys/stat.h> // fstat
+#include <time.h>     // clock_gettime
+#include <sched.h>    // sched_yield
 
 #include "civ_unix.h"
 
 /*extern*/ CivUnix civUnix          = (CivUnix) {};
+/*extern*/ _Thread_local CivUnixIO civUnixIO = (CivUnixIO) {};
 
 
 // Trace(unix) is adapted from https://stackoverflow.com/a/15130037/1036670
@@ -65,36 +72,145 @@ void defaultHandleSig(int sig, struct sigcontext ctx) {
 void defaultErrPrinter() { Trace_handleSig(0, NULL); }
 
 void CivUnix_allocBlocks(S numBlocks) {
-  void* mem = malloc(numBlocks * (BLOCK_SIZE + sizeof(BANode) + sizeof(Dll)));
+  S sz = numBlocks * (BLOCK_SIZE + BA_NODES_SZ) + sizeof(Dll);
+  void* mem = aligned_alloc(BLOCK_SIZE, align(sz, BLOCK_SIZE));
   Block*  blocks = (Block*)mem;
   BANode* nodes  = (BANode*)(blocks + numBlocks);
   assert((S) nodes == (S)mem + (BLOCK_SIZE * numBlocks));
   BA_freeArray(&civ.ba, numBlocks, nodes, blocks);
 
-  Dll* mallocDll = (Dll*)(nodes + numBlocks);
+  Dll* mallocDll = (Dll*)((U1*)nodes + numBlocks * BA_NODES_SZ);
   mallocDll->dat = mem;
   DllRoot_add(&civUnix.mallocs, mallocDll);
 }
 
-void CivUnix_init(S numBlocks) {
-  CivUnix_allocBlocks(numBlocks);
-  civUnix.logFile = UFile_new(Ring_init(civUnix.logBuf, STDOUT_BUF));
-  civUnix.outFile = UFile_new(Ring_init(civUnix.outBuf, STDOUT_BUF));
-  civUnix.logFile.fid = fileno(stderr); civUnix.outFile.fid = fileno(stdout);
-  civUnix.logFile.code = File_DONE;     civUnix.outFile.code = File_DONE;
-  civUnix.logBBA = BBA_new();
-  civUnix.log = FileLogger_init(
-      BBA_asArena(&civUnix.logBBA),
-      UFile_asFile(&civUnix.logFile),
+void CivUnix_buddy(Buddy* b, S numBlocks) {
+  S sz = numBlocks * BLOCK_SIZE + align(numBlocks, sizeof(Dll)) + sizeof(Dll);
+  U1* mem = aligned_alloc(BLOCK_SIZE, align(sz, BLOCK_SIZE));
+  ASSERT(mem, "CivUnix_buddy: OOM");
+  U1* meta = mem + numBlocks * BLOCK_SIZE;
+  Buddy_init(b, (Block*)mem, meta, numBlocks);
+
+  Dll* mallocDll = (Dll*)(meta + align(numBlocks, sizeof(Dll)));
+  mallocDll->dat = mem;
+  DllRoot_add(&civUnix.mallocs, mallocDll);
+}
+
+// Map len bytes of PROT_NONE address space aligned to `alignment`.
+static void* reserveAligned(S len, S alignment, int flags) {
+  U1* mem = mmap(NULL, len + alignment, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | flags, -1, 0);
+  if(MAP_FAILED == mem) return NULL;
+  U1* start = (U1*)(((S)mem + alignment - 1) & ~(alignment - 1));
+  if(start > mem) munmap(mem, start - mem);
+  munmap(start + len, (mem + len + alignment) - (start + len));
+  return start;
+}
+
+static S pageRound(S sz) {
+  S page = sysconf(_SC_PAGESIZE);
+  return (sz + page - 1) & ~(page - 1);
+}
+
+// Commit up to n more reserved blocks, freeing them into ba.
+static S UReserve_commit(UReserve* r, BA* ba, S n) {
+  n = S_min(n, r->cap - r->len);
+  if(not n) return 0;
+  if(mprotect(r->blocks + r->len, n * BLOCK_SIZE, PROT_READ | PROT_WRITE))
+    return 0;
+  // The nodes are committed as a page-rounded prefix of their reservation.
+  if(r->nodes and mprotect(r->nodes, pageRound((r->len + n) * sizeof(BANode)),
+                           PROT_READ | PROT_WRITE))
+    return 0;
+  BA_freeArray(ba, n, r->nodes + r->len, r->blocks + r->len);
+  r->len += n;
+  return n;
+}
+
+static bool CivUnix_growBlocks(BA* ba) {
+  return UReserve_commit(&civUnix.reserve, ba, UReserve_GROW);
+}
+
+void CivUnix_reserveBlocks(S maxBlocks, S numBlocks) {
+  UReserve* r = &civUnix.reserve;
+  ASSERT(not r->blocks, "CivUnix_reserveBlocks called twice");
+  maxBlocks = align(maxBlocks, UReserve_GROW);
+  S bytes = maxBlocks * BLOCK_SIZE;
+  // MAP_HUGETLB reserves from the (pre-configured) huge page pool up front and
+  // fails if it is too small. Don't use MAP_NORESERVE with it: touching an
+  // unbacked huge page is a SIGBUS.
+  r->pages = UReserve_HUGETLB;
+  r->blocks = mmap(NULL, bytes, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if(MAP_FAILED == r->blocks) {
+    r->pages = UReserve_THP;
+    r->blocks = reserveAligned(bytes, HUGE_PAGE_SIZE, 0);
+    ASSERT(r->blocks, "CivUnix_reserveBlocks: mmap failed");
+    if(madvise(r->blocks, bytes, MADV_HUGEPAGE)) r->pages = UReserve_SMALL;
+  }
+  if(not BA_INTRUSIVE) {
+    r->nodes = reserveAligned(pageRound(maxBlocks * sizeof(BANode)), 1, 0);
+    ASSERT(r->nodes, "CivUnix_reserveBlocks: mmap nodes failed");
+  }
+  r->cap = maxBlocks; r->len = 0;
+  UReserve_commit(r, &civ.ba, align(numBlocks, UReserve_GROW));
+  civ.ba.grow = CivUnix_growBlocks;
+}
+
+static void UReserve_drop(UReserve* r) {
+  if(not r->blocks) return;
+  munmap(r->blocks, r->cap * BLOCK_SIZE);
+  if(r->nodes) munmap(r->nodes, pageRound(r->cap * sizeof(BANode)));
+  *r = (UReserve) {0};
+}
+
+U8 CivUnix_now() {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (U8)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void CivUnix_sleep(U8 ns) {
+  struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+  while(nanosleep(&ts, &ts) and errno == EINTR) {}
+}
+
+static void CivUnix_initIO() {
+  CivUnixIO* io = &civUnixIO;
+  io->logFile = UFile_new(Ring_init(io->logBuf, STDOUT_BUF));
+  io->outFile = UFile_new(Ring_init(io->outBuf, STDOUT_BUF));
+  io->logFile.fid = fileno(stderr); io->outFile.fid = fileno(stdout);
+  io->logFile.code = File_DONE;     io->outFile.code = File_DONE;
+  io->logBBA = BBA_new();
+  io->log = FileLogger_init(
+      BBA_asArena(&io->logBBA),
+      UFile_asFile(&io->logFile),
       civ.logLvl);
-  civ.logFile = UFile_asFile(&civUnix.logFile);
-  civ.outFile = UFile_asFile(&civUnix.outFile);
-  civ.log     = FileLogger_asLogger(&civUnix.log);
+  civ.logFile = UFile_asFile(&io->logFile);
+  civ.outFile = UFile_asFile(&io->outFile);
+  civ.log     = FileLogger_asLogger(&io->log);
+}
+
+void CivUnix_init(S numBlocks) {
+  if(numBlocks) CivUnix_allocBlocks(numBlocks);
+  civ.now = CivUnix_now; civ.sleep = CivUnix_sleep;
+  CivUnix_initIO();
+}
+
+void CivUnix_initThread(Fiber* fb, Civ* from, BA* shared) {
+  Civ_initThread(fb, from, shared);
+  CivUnix_initIO();
+}
+
+void CivUnix_dropThread() {
+  File_flush(civ.logFile); File_flush(civ.outFile);
+  BBA_drop(&civUnixIO.logBBA);
+  Civ_dropThread();
 }
 
 void CivUnix_drop() {
   for(Dll* dll; (dll = DllRoot_pop(&civUnix.mallocs));) free(dll->dat);
   assert(NULL == civUnix.mallocs.start);
+  UReserve_drop(&civUnix.reserve);
   civ.ba = (BA) {0};
 }
 
@@ -117,8 +233,9 @@ UFile UFile_new(Ring ring) {
 }
 
 int UFile_handleErr(UFile* f, int res) {
+  if(res >= 0) return res;
   if(errno == EWOULDBLOCK) { errno = 0; return 0; }
-  if(res < 0) { f->code = File_EIO; }
+  f->code = File_EIO;
   return res;
 }
 
@@ -170,6 +287,15 @@ DEFINE_METHOD(void, UFile,read) {
   Slc avail = Ring_avail(r);
   if(avail.len) {
     len = read(this->fid, avail.dat, avail.len);
+    // Nothing available (i.e. an empty pipe): not EOF, stay READING.
+    // In a fiber, park until there is.
+    while((len < 0) and (errno == EWOULDBLOCK) and UPoller_canWait()) {
+      if(not UPoller_wait(this->fid, UPoll_IN, this->deadline)) {
+        errno = 0; this->code = File_ETIMEDOUT; return;
+      }
+      len = read(this->fid, avail.dat, avail.len);
+    }
+    if((len < 0) and (errno == EWOULDBLOCK)) { errno = 0; return; }
     len = UFile_handleErr(this, len);
     if(len < 0) return;
     Ring_incTail(r, len);
@@ -179,12 +305,18 @@ DEFINE_METHOD(void, UFile,read) {
 }
 
 DEFINE_METHOD(void, UFile,write) {
-  ASSERT(this->code == File_READING || this->code >= File_DONE, "write operation out of order");
+  ASSERT(this->code == File_WRITING || this->code >= File_DONE, "write operation out of order");
   this->code = File_WRITING;
   Ring* r = &this->ring;
   Slc first = Ring_1st(r);
   this->code = File_WRITING;
   int len = write(this->fid, first.dat, first.len);
+  while((len < 0) and (errno == EWOULDBLOCK) and UPoller_canWait()) {
+    if(not UPoller_wait(this->fid, UPoll_OUT, this->deadline)) {
+      errno = 0; this->code = File_ETIMEDOUT; return;
+    }
+    len = write(this->fid, first.dat, first.len);
+  }
   len     = UFile_handleErr(this, len);
   if(len < 0) return;
   Ring_incHead(r, len);
@@ -223,3 +355,537 @@ File UFile_asFile(UFile* d) {
   return (File) { .m = UFile_mFile(), .d = d };
 }
 
+
+static int fdSetFlags(int fd, int fdFlags, int flFlags) {
+  if(fdFlags and fcntl(fd, F_SETFD, fdFlags)) return errno;
+  if(flFlags and fcntl(fd, F_SETFL, flFlags)) return errno;
+  return 0;
+}
+
+static int fdsPipe(int fds[2]) {
+  if(pipe(fds)) return errno;
+  int res = fdSetFlags(fds[0], FD_CLOEXEC, 0);
+  if(not res) res = fdSetFlags(fds[1], FD_CLOEXEC, 0);
+  if(res) { close(fds[0]); close(fds[1]); }
+  return res;
+}
+
+int UFile_pipe(UFile* r, UFile* w) {
+  int fds[2]; int res = fdsPipe(fds); if(res) return res;
+  fdSetFlags(fds[0], 0, O_NONBLOCK); fdSetFlags(fds[1], 0, O_NONBLOCK);
+  r->fid = fds[0]; r->code = File_DONE; Ring_clear(&r->ring);
+  w->fid = fds[1]; w->code = File_DONE; Ring_clear(&w->ring);
+  return 0;
+}
+
+// #################################
+// # UProc
+extern char** environ;
+
+// Create the pipe for one child stream, storing the child's end in *child.
+// The child's end stays blocking (most programs expect that) and is dup'd onto
+// childFd by the spawn.
+static int UProc_pipe(posix_spawn_file_actions_t* fa,
+                      UFile* f, Ring ring, int childFd, int* child) {
+  *f = UFile_new(ring); *child = -1;
+  if(not ring.dat) return 0;
+  int fds[2]; int res = fdsPipe(fds); if(res) return res;
+  int parent = (0 == childFd) ? fds[1] : fds[0];
+  *child     = (0 == childFd) ? fds[0] : fds[1];
+  f->fid = parent; f->code = File_DONE;
+  if((res = fdSetFlags(parent, 0, O_NONBLOCK))) return res;
+  return posix_spawn_file_actions_adddup2(fa, *child, childFd);
+}
+
+static void UProc_closeParentEnd(UFile* f) {
+  if(f->code == File_CLOSED) return;
+  close(f->fid); f->code = File_CLOSED;
+}
+
+int UProc_spawn(UProc* p, char* const argv[], Ring in, Ring out, Ring err) {
+  *p = (UProc) { .pid = -1,
+    .in = UFile_new((Ring){0}), .out = UFile_new((Ring){0}), .err = UFile_new((Ring){0}) };
+  posix_spawn_file_actions_t fa;
+  int res = posix_spawn_file_actions_init(&fa); if(res) return res;
+  int child[3] = {-1, -1, -1};
+  if(   (res = UProc_pipe(&fa, &p->in,  in,  0, &child[0]))
+     or (res = UProc_pipe(&fa, &p->out, out, 1, &child[1]))
+     or (res = UProc_pipe(&fa, &p->err, err, 2, &child[2]))) goto done;
+  res = posix_spawnp(&p->pid, argv[0], &fa, NULL, argv, environ);
+done:
+  for(int i = 0; i < 3; i++) if(child[i] >= 0) close(child[i]);
+  if(res) {
+    UProc_closeParentEnd(&p->in);
+    UProc_closeParentEnd(&p->out);
+    UProc_closeParentEnd(&p->err);
+  }
+  posix_spawn_file_actions_destroy(&fa);
+  return res;
+}
+
+int UProc_wait(UProc* p) {
+  UProc_closeParentEnd(&p->in);
+  while(waitpid(p->pid, &p->status, 0) < 0) {
+    ASSERT(errno == EINTR, "UProc_wait: waitpid failed");
+  }
+  if(WIFSIGNALED(p->status)) return 128 + WTERMSIG(p->status);
+  return WEXITSTATUS(p->status);
+}
+
+// #################################
+// # UPoller
+
+#define UPoller_EVENTS 64
+
+static void UPoller_poll(Sched* s, U8 ns) {
+  UPoller* p = s->poller;
+  struct epoll_event evs[UPoller_EVENTS];
+  int ms = -1; // forever
+  if(ns != (U8)-1) {
+    U8 m = ns / 1000000 + (ns % 1000000 != 0);
+    ms = (m > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)m;
+  }
+  int n = epoll_wait(p->epfd, evs, UPoller_EVENTS, ms);
+  for(int i = 0; i < n; i++) Sched_unpark(evs[i].data.ptr);
+}
+
+int UPoller_init(UPoller* p, Sched* s) {
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(p->epfd < 0) return errno;
+  s->poll = UPoller_poll; s->poller = p;
+  return 0;
+}
+
+void UPoller_drop(UPoller* p) { close(p->epfd); p->epfd = -1; }
+
+bool UPoller_wait(int fd, U4 events, U8 at) {
+  ASSERT(UPoller_canWait(), "UPoller_wait: not in a polled fiber");
+  Sched* s = civ.sched; UPoller* p = s->poller;
+  // One-shot: the registration is disarmed once it fires, so it never
+  // wakes this fiber twice.
+  struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = civ.fb };
+  ASSERT(0 == epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev), "UPoller_wait: epoll_ctl failed");
+  s->ioWaits += 1;
+  bool timedOut = false;
+  if(at) timedOut = Sched_parkUntil(at);
+  else   Sched_park();
+  s->ioWaits -= 1;
+  // Always remove it: a disarmed registration would still report
+  // EPOLLHUP/EPOLLERR, waking this fiber later (or after it is freed), and
+  // the next wait on fd (maybe by another fiber) adds its own.
+  epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+  return not timedOut;
+}
+
+// #################################
+// # UPool
+
+// Largest power of 2 number of Fiber pointers which fit in a block.
+#define UPool_DEQUE  ((S)1 << (31 - __builtin_clz(BLOCK_AVAIL / sizeof(Fiber*))))
+
+// Idle rounds (of sched_yield) before a worker sleeps.
+#define UPool_SPINS  64
+
+void UPool_init(UPool* p, UWorker* workers, U2 len) {
+  BA* ba = civ.ba.parent ? civ.ba.parent : &civ.ba; // see Civ_share
+  *p = (UPool) { .workers = workers, .len = len, .ba = ba,
+    .mu = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+}
+
+// Not inline: the thread-local civ must be looked up after every switch.
+__attribute__((noinline)) void UPool_yield() { Fiber_switch(civ.fb->caller); }
+__attribute__((noinline)) Civ* UPool_civ()   { return &civ; }
+
+// The worker running on this thread (if any).
+static _Thread_local UWorker* UWorker_cur;
+
+// Wake sleeping workers after publishing work (or the last fiber finishing).
+// The fence pairs with UPool_park's: either it sees the work or we see it.
+static void UPool_notify(UPool* p, bool all) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(not __atomic_load_n(&p->sleeping, __ATOMIC_RELAXED)) return;
+  pthread_mutex_lock(&p->mu);
+  if(all) pthread_cond_broadcast(&p->wake);
+  else    pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->mu);
+}
+
+static bool UPool_hasWork(UPool* p) {
+  if(__atomic_load_n(&p->inject, __ATOMIC_RELAXED)) return true;
+  if(not __atomic_load_n(&p->live, __ATOMIC_RELAXED)) return true; // to exit
+  for(U2 i = 0; i < p->len; i++) {
+    Deque* q = &p->workers[i].q;
+    if(__atomic_load_n(&q->bottom, __ATOMIC_RELAXED)
+       > __atomic_load_n(&q->top, __ATOMIC_RELAXED)) return true;
+  }
+  return false;
+}
+
+static void UPool_park(UPool* p) {
+  pthread_mutex_lock(&p->mu);
+  __atomic_add_fetch(&p->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(not UPool_hasWork(p)) pthread_cond_wait(&p->wake, &p->mu);
+  __atomic_sub_fetch(&p->sleeping, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&p->mu);
+}
+
+static void UPool_inject(UPool* p, Fiber* fb) {
+  Spin_lock(&p->lock);
+  fb->next = p->inject; p->inject = fb;
+  Spin_unlock(&p->lock);
+  UPool_notify(p, false);
+}
+
+void UPool_spawn(UPool* p, Fiber* fb) {
+  __atomic_add_fetch(&p->live, 1, __ATOMIC_RELAXED);
+  UWorker* w = UWorker_cur; // the worker's thread owns its Deque
+  if(w and (w->pool == p) and Deque_push(&w->q, fb)) UPool_notify(p, false);
+  else UPool_inject(p, fb);
+}
+
+static Fiber* UPool_take(UPool* p) {
+  if(not __atomic_load_n(&p->inject, __ATOMIC_RELAXED)) return NULL;
+  Spin_lock(&p->lock);
+  Fiber* fb = p->inject;
+  if(fb) p->inject = fb->next;
+  Spin_unlock(&p->lock);
+  return fb;
+}
+
+// Steal from up to len random victims.
+static Fiber* UWorker_steal(UWorker* w) {
+  UPool* p = w->pool;
+  for(U2 i = 0; i < p->len; i++) {
+    w->rng ^= w->rng << 13; w->rng ^= w->rng >> 17; w->rng ^= w->rng << 5;
+    UWorker* v = &p->workers[w->rng % p->len];
+    if(v == w) continue;
+    Fiber* fb = Deque_steal(&v->q);
+    if(fb) return fb;
+  }
+  return NULL;
+}
+
+static void* UWorker_main(void* arg) {
+  UWorker* w = arg; UPool* p = w->pool;
+  jmp_buf errJmp; Fiber root; Fiber_init(&root, &errJmp);
+  CivUnix_initThread(&root, &p->civ, p->ba); UWorker_cur = w;
+  if(setjmp(errJmp)) {
+    eprintf("!! UPool worker error: %.*s\n", Dat_fmt(root.err));
+    exit(1);
+  }
+  U2 idle = 0;
+  while(__atomic_load_n(&p->live, __ATOMIC_ACQUIRE)) {
+    Fiber* fb = Deque_pop(&w->q);
+    if(not fb) fb = UPool_take(p);
+    if(not fb) fb = UWorker_steal(w);
+    if(not fb) {
+      if(++idle < UPool_SPINS) sched_yield();
+      else { UPool_park(p); idle = 0; }
+      continue;
+    }
+    idle = 0; w->ran += 1;
+    Fiber_switch(fb);
+    // Requeue here (not in UPool_yield): until the switch back the fiber was
+    // still running on this stack, so it could not be stolen.
+    if(fb->state & Fiber_DONE) {
+      if(not __atomic_sub_fetch(&p->live, 1, __ATOMIC_RELEASE)) UPool_notify(p, true);
+    } else if(Deque_push(&w->q, fb)) UPool_notify(p, false); // can be stolen
+    else UPool_inject(p, fb);
+  }
+  UWorker_cur = NULL; CivUnix_dropThread();
+  return NULL;
+}
+
+int UPool_run(UPool* p) {
+  p->civ = civ;
+  for(U2 i = 0; i < p->len; i++) {
+    UWorker* w = &p->workers[i];
+    *w = (UWorker) { .pool = p, .rng = 0x9E3779B9 * (i + 1) };
+    BA_lock(p->ba); w->qBlock = BA_alloc(p->ba); BA_unlock(p->ba);
+    ASSERT(w->qBlock, "UPool_run: OOM");
+    w->q = Deque_init((Fiber**)BANode_block(w->qBlock)->dat, UPool_DEQUE);
+  }
+  U2 started = 0; int err = 0;
+  for(; started < p->len; started++) {
+    UWorker* w = &p->workers[started];
+    if((err = pthread_create(&w->th, NULL, UWorker_main, w))) break;
+  }
+  for(U2 i = 0; i < started; i++) pthread_join(p->workers[i].th, NULL);
+  BA_lock(p->ba);
+  for(U2 i = 0; i < p->len; i++) BA_free(p->ba, p->workers[i].qBlock);
+  BA_unlock(p->ba);
+  return err;
+}
+
+// #################################
+// # UTaskPool
+
+void UTask_after(UTask* t, UTask* dep) {
+  ASSERT(dep->thenLen < UTask_THEN, "UTask_after: too many successors");
+  dep->then[dep->thenLen++] = t;
+  t->pending += 1;
+}
+
+// Add a task whose dependencies are done to the ready queue.
+static void UTaskPool_ready(UTaskPool* p, UTask* t) {
+  t->next = NULL;
+  pthread_mutex_lock(&p->mu);
+  if(p->tail) p->tail->next = t;
+  else        p->head = t;
+  p->tail = t;
+  pthread_cond_signal(&p->ready);
+  pthread_mutex_unlock(&p->mu);
+}
+
+// Release one of t's dependencies.
+static void UTask_release(UTaskPool* p, UTask* t) {
+  if(0 == __atomic_sub_fetch(&t->pending, 1, __ATOMIC_ACQ_REL)) UTaskPool_ready(p, t);
+}
+
+void UTaskPool_submit(UTaskPool* p, UTask* t) {
+  pthread_mutex_lock(&p->mu); p->pending += 1; pthread_mutex_unlock(&p->mu);
+  UTask_release(p, t);
+}
+
+static void* UTaskWorker_main(void* arg) {
+  UTaskWorker* w = arg; UTaskPool* p = w->pool;
+  jmp_buf errJmp; Fiber root; Fiber_init(&root, &errJmp);
+  CivUnix_initThread(&root, &p->civ, p->ba);
+  if(setjmp(errJmp)) {
+    eprintf("!! UTaskPool worker error: %.*s\n", Dat_fmt(root.err));
+    exit(1);
+  }
+  w->scratch = BBA_new();
+  BBA_alloc(&w->scratch, 1, 1); // keep a block between tasks
+  BBAMark mark = BBA_mark(&w->scratch);
+  while(true) {
+    pthread_mutex_lock(&p->mu);
+    while(not p->head and not p->stop) pthread_cond_wait(&p->ready, &p->mu);
+    UTask* t = p->head;
+    if(t and not (p->head = t->next)) p->tail = NULL;
+    pthread_mutex_unlock(&p->mu);
+    if(not t) break; // stopped
+
+    // Copy the successors first: once fn returns, t may be gone (see UFor_run).
+    U1 thenLen = t->thenLen; UTask* then[UTask_THEN];
+    memcpy(then, t->then, thenLen * sizeof(UTask*));
+    jmp_buf taskJmp; root.errJmp = &taskJmp; bool failed = false;
+    if(setjmp(taskJmp)) {
+      t->err = root.err; failed = true;
+      root.err = (Slc){0}; root.state &= ~Fiber_EXPECT_ERR;
+    } else t->fn(t, &w->scratch);
+    root.errJmp = &errJmp; w->ran += 1;
+    BBA_reset(&w->scratch, mark);
+    for(U1 i = 0; i < thenLen; i++) UTask_release(p, then[i]);
+
+    pthread_mutex_lock(&p->mu);
+    p->errors += failed;
+    if(0 == --p->pending) pthread_cond_broadcast(&p->idle);
+    pthread_mutex_unlock(&p->mu);
+  }
+  BBA_drop(&w->scratch);
+  CivUnix_dropThread();
+  return NULL;
+}
+
+int UTaskPool_init(UTaskPool* p, UTaskWorker* workers, U2 len) {
+  ASSERT(len <= UTaskPool_MAX, "UTaskPool_init: too many workers");
+  *p = (UTaskPool) { .workers = workers };
+  pthread_mutex_init(&p->mu, NULL);
+  pthread_cond_init(&p->ready, NULL); pthread_cond_init(&p->idle, NULL);
+  if(civ.ba.parent) p->ba = civ.ba.parent;
+  else { Civ_share(&p->shared); p->ba = &p->shared; p->unshare = true; }
+  p->civ = civ;
+  for(; p->len < len; p->len++) {
+    UTaskWorker* w = &workers[p->len];
+    *w = (UTaskWorker) { .pool = p };
+    int err = pthread_create(&w->th, NULL, UTaskWorker_main, w);
+    if(err) { UTaskPool_drop(p); return err; }
+  }
+  return 0;
+}
+
+S UTaskPool_wait(UTaskPool* p) {
+  pthread_mutex_lock(&p->mu);
+  while(p->pending) pthread_cond_wait(&p->idle, &p->mu);
+  S errors = p->errors; p->errors = 0;
+  pthread_mutex_unlock(&p->mu);
+  return errors;
+}
+
+void UTaskPool_drop(UTaskPool* p) {
+  UTaskPool_wait(p);
+  pthread_mutex_lock(&p->mu); p->stop = true;
+  pthread_cond_broadcast(&p->ready); pthread_mutex_unlock(&p->mu);
+  for(U2 i = 0; i < p->len; i++) pthread_join(p->workers[i].th, NULL);
+  pthread_cond_destroy(&p->ready); pthread_cond_destroy(&p->idle);
+  pthread_mutex_destroy(&p->mu);
+  if(p->unshare) Civ_unshare(&p->shared);
+  p->len = 0;
+}
+
+typedef struct {
+  UTaskPool* p; UForFn fn; void* arg; S len; S grain;
+  S chunks; S next;        // chunks (counting chunks can't overflow)
+  S running; Slc err;      // tasks not finished and the first error (on p->mu)
+} UFor;
+
+// Take chunks until there are none left (or one fails), resetting scratch
+// after each. The last task to finish wakes UTaskPool_for, after which f and
+// t are gone.
+static void UFor_run(UTask* t, BBA* scratch) {
+  UFor* f = t->arg; BBAMark mark = BBA_mark(scratch);
+  Fiber* fb = civ.fb; jmp_buf* prevJmp = fb->errJmp;
+  jmp_buf errJmp; fb->errJmp = &errJmp;
+  Slc err = {0};
+  if(setjmp(errJmp)) {
+    err = fb->err; fb->err = (Slc){0}; fb->state &= ~Fiber_EXPECT_ERR;
+    __atomic_store_n(&f->next, f->chunks, __ATOMIC_RELAXED); // start no more
+  } else while(true) {
+    S c = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED);
+    if(c >= f->chunks) break;
+    S start = c * f->grain;
+    f->fn(f->arg, start, start + S_min(f->grain, f->len - start), scratch);
+    BBA_reset(scratch, mark);
+  }
+  fb->errJmp = prevJmp;
+  UTaskPool* p = f->p;
+  pthread_mutex_lock(&p->mu);
+  if(err.len and not f->err.len) f->err = err;
+  if(0 == --f->running) pthread_cond_broadcast(&p->idle);
+  pthread_mutex_unlock(&p->mu);
+}
+
+Slc UTaskPool_for(UTaskPool* p, S len, S grain, UForFn fn, void* arg) {
+  ASSERT(grain, "UTaskPool_for: grain is 0");
+  S chunks = len / grain + (len % grain != 0);
+  UFor f = { .p = p, .fn = fn, .arg = arg, .len = len, .grain = grain,
+             .chunks = chunks, .running = S_min(p->len, chunks) };
+  UTask t[UTaskPool_MAX];
+  S tasks = f.running;
+  for(S i = 0; i < tasks; i++) {
+    t[i] = UTask_init(UFor_run, &f);
+    UTaskPool_submit(p, &t[i]);
+  }
+  pthread_mutex_lock(&p->mu);
+  while(f.running) pthread_cond_wait(&p->idle, &p->mu);
+  pthread_mutex_unlock(&p->mu);
+  return f.err;
+}
+
+// #################################
+// # ULogDrain
+
+static void* ULogDrain_main(void* arg) {
+  ULogDrain* d = arg;
+  jmp_buf errJmp; Fiber root; Fiber_init(&root, &errJmp);
+  Civ_init(&root, LOG_SET_ERROR); civ.now = CivUnix_now; civ.sleep = CivUnix_sleep;
+  if(setjmp(errJmp)) {
+    eprintf("!! ULogDrain error: %.*s\n", Dat_fmt(root.err));
+    exit(1);
+  }
+  while(not __atomic_load_n(&d->stop, __ATOMIC_ACQUIRE)) {
+    if(not LogQueue_drain(d->q, d->f)) CivUnix_sleep(d->idleNs);
+  }
+  LogQueue_drain(d->q, d->f);
+  return NULL;
+}
+
+int ULogDrain_start(ULogDrain* d, LogQueue* q, File f) {
+  *d = (ULogDrain) { .q = q, .f = f, .idleNs = ULogDrain_IDLE };
+  return pthread_create(&d->th, NULL, ULogDrain_main, d);
+}
+
+void ULogDrain_stop(ULogDrain* d) {
+  __atomic_store_n(&d->stop, true, __ATOMIC_RELEASE);
+  pthread_join(d->th, NULL);
+}
+
+// #################################
+// # UPersist
+
+// Header and BANodes, rounded so that the blocks are BLOCK_SIZE aligned.
+static S UPersist_hdrBytes(S len) {
+  S sz = sizeof(UPersistHdr) + len * BA_NODES_SZ;
+  return (sz + BLOCK_SIZE - 1) & ~(S)(BLOCK_SIZE - 1);
+}
+
+static UPersistHdr UPersist_layout(void* base, S len) {
+  return (UPersistHdr) {
+    .magic = UPersist_MAGIC, .blockAvail = BLOCK_AVAIL, .rsize = RSIZE,
+    .intrusive = BA_INTRUSIVE, .base = base, .len = len,
+  };
+}
+
+static int UPersist_err(UPersist* p, int err) {
+  close(p->fd); *p = (UPersist) { .fd = -1 };
+  return err;
+}
+
+int UPersist_open(UPersist* p, Slc path, void* base, S numBlocks) {
+  ASSERT(path.len < 255, "UPersist path len >= 255");
+  ASSERT(not ((S)base & (BLOCK_SIZE - 1)), "UPersist base must be block aligned");
+  char pathname[256];
+  memcpy(pathname, path.dat, path.len); pathname[path.len] = 0;
+  *p = (UPersist) { .fd = open(pathname, O_RDWR | O_CREAT | O_CLOEXEC, 0666) };
+  if(p->fd < 0) return errno;
+  struct stat st; if(fstat(p->fd, &st)) return UPersist_err(p, errno);
+
+  // A create marks the file CREATING before sizing it and writes the magic
+  // last, so any other file (i.e. not ours) is never overwritten.
+  UPersistHdr h = {0};
+  if(st.st_size and (sizeof(h) != pread(p->fd, &h, sizeof(h), 0)))
+    return UPersist_err(p, EINVAL);
+  bool create = (0 == st.st_size) or (UPersist_CREATING == h.magic);
+  if(not create and (UPersist_MAGIC != h.magic)) return UPersist_err(p, EINVAL);
+  if(create) {
+    if(not (base and numBlocks)) return UPersist_err(p, EINVAL);
+    h = UPersist_layout(base, numBlocks); h.magic = UPersist_CREATING;
+    p->bytes = UPersist_hdrBytes(numBlocks) + numBlocks * BLOCK_SIZE;
+    if(ftruncate(p->fd, 0)
+       or (sizeof(h) != pwrite(p->fd, &h, sizeof(h), 0))
+       or ftruncate(p->fd, p->bytes))
+      return UPersist_err(p, errno ? errno : EIO);
+    h.magic = UPersist_MAGIC;
+  } else {
+    if(not base) base = h.base;
+    UPersistHdr expect = UPersist_layout(base, h.len);
+    if(memcmp(&h, &expect, offsetof(UPersistHdr, len))) return UPersist_err(p, EINVAL);
+    p->bytes = UPersist_hdrBytes(h.len) + h.len * BLOCK_SIZE;
+    if(st.st_size < p->bytes) return UPersist_err(p, EINVAL);
+  }
+
+  // MAP_FIXED_NOREPLACE fails (or on old kernels, is only a hint) instead of
+  // clobbering an existing mapping.
+  U1* mem = mmap(base, p->bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED_NOREPLACE, p->fd, 0);
+  int err = (MAP_FAILED == mem) ? errno : 0;
+  if(not err and mem != base) { munmap(mem, p->bytes); err = EEXIST; }
+  if(err) {
+    if(create) ftruncate(p->fd, 0); // don't leave an unusable file behind
+    return UPersist_err(p, err);
+  }
+  p->hdr = (UPersistHdr*)mem;
+  if(create) {
+    UPersistHdr* hdr = p->hdr;
+    BA_freeArray(&hdr->ba, h.len, (BANode*)(hdr + 1),
+                 (Block*)(mem + UPersist_hdrBytes(h.len)));
+    hdr->blockAvail = h.blockAvail; hdr->rsize = h.rsize;
+    hdr->intrusive  = h.intrusive;  hdr->base  = h.base; hdr->len = h.len;
+    hdr->magic = h.magic;
+  }
+  // Only the free list is persistent.
+  BA* ba = &p->hdr->ba; ba->grow = NULL; ba->parent = NULL; ba->lock = 0;
+  return 0;
+}
+
+int UPersist_sync(UPersist* p) {
+  return msync(p->hdr, p->bytes, MS_SYNC) ? errno : 0;
+}
+
+void UPersist_close(UPersist* p) {
+  if(p->hdr) munmap(p->hdr, p->bytes);
+  if(p->fd >= 0) close(p->fd);
+  *p = (UPersist) { .fd = -1 };
+}
@@ -4,6 +4,9 @@
 #include <fcntl.h>  // create, open
 #include <execinfo.h>
 #include <signal.h>
+#include <sys/types.h> // pid_t
+#include <sys/epoll.h>
+#include <pthread.h>
 #include "civ.h"
 
 #define TEST_UNIX(NAME, numBlocks) \
@@ -35,6 +38,7 @@ typedef struct {
   U2        code;     // status or error (File_*)
   Sll*      nextResource; // resource SLL
   S         fid;      // file id
+  U8        deadline; // civ.now time a parked read/write gives up (0: never)
 } UFile;
 
 #define File_RDWR      O_RDWR
@@ -61,20 +65,338 @@ DECLARE_METHOD(void,      UFile,read);
 DECLARE_METHOD(void,      UFile,write);
 File UFile_asFile(UFile* d);
 
-#define STDOUT_BUF 128
+// Create a pipe. Both ends are non-blocking and close-on-exec.
+// Returns 0 on success, else the errno.
+int UFile_pipe(UFile* r, UFile* w);
+
+// #################################
+// # UProc: a child process with pipe File endpoints
+// The child's stdin/stdout/stderr are connected to non-blocking pipes. The
+// parent ends are UFiles, so they work with the File role (File_extend,
+// File_flush, File_consume, etc). A stream whose Ring has no dat is inherited
+// from the parent instead.
+//
+// Typical use:
+//   UProc p;
+//   UProc_spawn(&p, (char*[]){"tr", "a-z", "A-Z", NULL}, inR, outR, (Ring){0});
+//   File_extend(UFile_asFile(&p.in), SLC("hi")); File_flush(...);
+//   UFile_close(&p.in);    // child sees EOF
+//   ... File_consume(UFile_asFile(&p.out), &buf) until File_eof ...
+//   UFile_close(&p.out); UProc_wait(&p);
+typedef struct {
+  pid_t pid;
+  int   status;    // raw status from waitpid
+  UFile in;        // child's stdin  (parent writes)
+  UFile out;       // child's stdout (parent reads)
+  UFile err;       // child's stderr (parent reads)
+} UProc;
+
+// Spawn argv[0] (searched in PATH), initializing p. Returns 0 on success,
+// else the errno (with every parent end closed).
+int UProc_spawn(UProc* p, char* const argv[], Ring in, Ring out, Ring err);
+
+// Close p->in (if open) and wait for the child to exit.
+// Returns the exit code, or 128 + signal if it was killed.
+//
+// Note: read stdout/stderr first, the child may block on a full pipe.
+int UProc_wait(UProc* p);
+
+// #################################
+// # UPoller: epoll based I/O waits for Sched fibers
+// Once a Sched has a UPoller, UFile reads and writes from its fibers which
+// would block (EWOULDBLOCK) park the fiber until the fd is ready and then
+// retry, so synchronous looking code (UFile_readAll, File_flush, etc) lets
+// other fibers run instead of spinning. Outside of a scheduled fiber they
+// behave as before (returning without progress).
+//
+// Only one fiber may wait on an fd at a time. Regular files are always ready.
+// A UFile's deadline bounds its parked reads and writes: past it they stop
+// with code File_ETIMEDOUT (the file can still be used afterwards).
+//
+//   Sched s; Sched_init(&s); UPoller p; UPoller_init(&p, &s);
+//   ... spawn fibers doing UFile I/O on pipes/sockets ...
+//   Sched_run(&s); UPoller_drop(&p);
+#define UPoll_IN   EPOLLIN
+#define UPoll_OUT  EPOLLOUT
+
+typedef struct { int epfd; } UPoller;
+
+// Returns 0 or errno.
+int  UPoller_init(UPoller* p, Sched* s);
+void UPoller_drop(UPoller* p);
+
+// True if the current fiber can park with UPoller_wait.
+static inline bool UPoller_canWait() {
+  return civ.sched and civ.sched->poll and (civ.fb != civ.sched->loop);
+}
+
+// Park until fd is ready for events (UPoll_*) or `at` (civ.now time, 0: no
+// timeout). Returns false if it timed out.
+bool UPoller_wait(int fd, U4 events, U8 at);
+
+// UReserve: reserved address space for blocks, committed on demand.
+#define UReserve_SMALL    0 // normal pages
+#define UReserve_THP      1 // transparent huge pages (madvise)
+#define UReserve_HUGETLB  2 // MAP_HUGETLB
+
+#define HUGE_PAGE_SIZE    (2 << 20)
+#define UReserve_GROW     (HUGE_PAGE_SIZE / BLOCK_SIZE) // blocks per commit
+
+typedef struct {
+  Block*  blocks;  BANode* nodes;  // reserved address space
+  S       cap;     // reserved blocks
+  S       len;     // committed blocks
+  U1      pages;   // UReserve_(SMALL|THP|HUGETLB)
+} UReserve;
+
 typedef struct {
   DllRoot mallocs;
+  UReserve reserve;
+} CivUnix;
+
+// Per-thread buffered stderr/stdout and logger (civ.logFile/outFile/log).
+#define STDOUT_BUF 128
+typedef struct {
   UFile logFile;
   UFile outFile;
   U1 logBuf[STDOUT_BUF]; U1 outBuf[STDOUT_BUF];
   FileLogger log;  BBA logBBA;
-} CivUnix;
+} CivUnixIO;
 
-extern CivUnix civUnix;;
+extern CivUnix civUnix;
+extern _Thread_local CivUnixIO civUnixIO;
 
+// Initialize civ and civUnix. numBlocks are malloc'd (BLOCK_SIZE aligned) for
+// civ.ba (may be 0).
 void CivUnix_init(S numBlocks);
 void CivUnix_drop();
+
+// Civ_initThread, then give the thread its own civUnixIO (see Civ_share).
+void CivUnix_initThread(Fiber* fb, Civ* from, BA* shared);
+void CivUnix_dropThread();
+
+// Monotonic clock in nanoseconds (civ.now).
+U8 CivUnix_now();
+void CivUnix_sleep(U8 ns); // civ.sleep
 void CivUnix_allocBlocks(S numBlocks);
 
+// Initialize b over numBlocks freshly malloc'd (BLOCK_SIZE aligned) blocks.
+// They are freed by CivUnix_drop.
+void CivUnix_buddy(Buddy* b, S numBlocks);
+
+// Reserve (but do not commit) address space for up to maxBlocks and give civ.ba
+// the first numBlocks. When civ.ba runs dry, another UReserve_GROW blocks
+// (one huge page) are committed. Huge pages are used when available: first
+// MAP_HUGETLB, else transparent huge pages.
+//
+// Both counts are rounded up to UReserve_GROW. Can only be called once.
+void CivUnix_reserveBlocks(S maxBlocks, S numBlocks);
+
+
+// #################################
+// # UPool: M:N work-stealing Fiber runtime
+// Runs fibers on a pool of worker threads. Each worker owns a Deque (in a
+// block from the BA) which it pops from, and steals from a random victim's
+// Deque when it is empty. Fibers spawned from a pool fiber go on its worker's
+// Deque; from outside a worker (or when a Deque is full) they go on a shared,
+// locked inject queue.
+//
+// Inside a pool fiber, UPool_yield lets other fibers run; it may resume on
+// another worker. Each worker is initialized with CivUnix_initThread, with
+// civ.ba a BA_cache over the spawning thread's civ.ba (or its shared BA when
+// Civ_share was called, which is required if other threads use it meanwhile).
+//
+// Workers with nothing to run spin briefly, then sleep until fibers are
+// spawned or requeued.
+//
+// Note: since a fiber can change threads at UPool_yield and civ is
+// thread-local, a pool fiber must not use civ (or pointers into it, i.e.
+// &civ.ba) after a UPool_yield in the same function: the compiler may reuse
+// the address of the previous thread's civ. Use UPool_civ() after yielding.
+// The error macros (ASSERT, SET_ERR, etc) look up the fiber with Civ_fb(), so
+// are safe to use anywhere.
+//
+//   UPool p; UWorker w[4]; UPool_init(&p, w, 4);
+//   for(...) { Fiber_alloc(&fb[i], ...); UPool_spawn(&p, &fb[i]); }
+//   UPool_run(&p); // returns once all fibers are DONE
+typedef struct _UWorker {
+  pthread_t th; struct _UPool* pool;
+  Deque q; BANode* qBlock;
+  U4 rng;                  // victim selection
+  S ran;                   // fibers resumed (stats)
+} UWorker;
+
+typedef struct _UPool {
+  UWorker* workers; U2 len;
+  BA* ba;                  // shared parent of the workers' BA caches
+  Civ civ;                 // template for the workers' civ
+  Fiber* inject; U1 lock;  // Sll (on next) of spawned fibers
+  S live;                  // spawned fibers not DONE
+  pthread_mutex_t mu; pthread_cond_t wake; U2 sleeping; // idle workers
+} UPool;
+
+void UPool_init(UPool* p, UWorker* workers, U2 len);
+
+// Add a fiber (see Fiber_new). May be called from any thread or pool fiber.
+void UPool_spawn(UPool* p, Fiber* fb);
+
+// Start the workers and wait for all fibers to be DONE.
+// Returns 0 or the errno from creating a thread.
+int  UPool_run(UPool* p);
+
+// From a pool fiber: let other fibers run.
+void UPool_yield();
+
+// From a pool fiber: the civ of the thread it is currently running on.
+Civ* UPool_civ();
+
+// #################################
+// # UTaskPool: parallel-for and task graphs on a fixed thread pool
+// Tasks run on len worker threads, started by UTaskPool_init and stopped by
+// UTaskPool_drop. Each worker has a scratch BBA which a task can allocate
+// from freely: it is reset (BBA_mark/BBA_reset) after every task, and after
+// every chunk of a UTaskPool_for.
+//
+// Task graphs use continuation counters: t->pending counts the unfinished
+// tasks it waits on (see UTask_after) plus one until it is submitted. When a
+// task finishes it decrements each of its successors and readies those which
+// reach zero.
+//
+// An error raised by a task (SET_ERR, ASSERT, etc) is caught by its worker and
+// stored in t->err; its successors still run. UTaskPool_wait returns how many
+// tasks raised one.
+//
+//   UTaskPool p; UTaskWorker w[4]; UTaskPool_init(&p, w, 4);
+//   UTask a = UTask_init(loadFn, x), b = UTask_init(sortFn, x);
+//   UTask_after(&b, &a);
+//   UTaskPool_submit(&p, &b); UTaskPool_submit(&p, &a);
+//   UTaskPool_wait(&p);
+//   UTaskPool_for(&p, len, 1024, sumFn, &sums); // blocks until done
+//   UTaskPool_drop(&p);
+//
+// The workers allocate through BA_caches over civ.ba's shared BA, so
+// UTaskPool_init calls Civ_share (unless it already was) and UTaskPool_drop
+// undoes it. Don't wait (or call UTaskPool_for) from inside a task.
+#define UTask_THEN     4  // max successors of a task
+#define UTaskPool_MAX  64 // max workers
+
+typedef struct _UTask {
+  struct _UTask* next;     // ready queue
+  void (*fn)(struct _UTask* t, BBA* scratch); void* arg;
+  U4 pending;              // unfinished dependencies (+1 until submitted)
+  U1 thenLen; struct _UTask* then[UTask_THEN]; // successors
+  Slc err;                 // the error fn raised, if any
+} UTask;
+
+typedef struct _UTaskWorker {
+  pthread_t th; struct _UTaskPool* pool;
+  BBA scratch;
+  S ran;                   // tasks run (stats)
+} UTaskWorker;
+
+typedef struct _UTaskPool {
+  UTaskWorker* workers; U2 len;
+  pthread_mutex_t mu; pthread_cond_t ready; pthread_cond_t idle;
+  UTask* head; UTask* tail; // ready queue (FIFO)
+  S pending;               // submitted and not finished
+  S errors;                // tasks which raised an error (since the last wait)
+  bool stop;
+  BA* ba; BA shared; bool unshare; // see Civ_share
+  Civ civ;                 // template for the workers' civ
+} UTaskPool;
+
+static inline UTask UTask_init(void (*fn)(UTask* t, BBA* scratch), void* arg) {
+  return (UTask) { .fn = fn, .arg = arg, .pending = 1 };
+}
+
+// t runs after dep has finished. Call before submitting either.
+void UTask_after(UTask* t, UTask* dep);
+
+// Start len workers. Returns 0 or the errno from creating a thread.
+int  UTaskPool_init(UTaskPool* p, UTaskWorker* workers, U2 len);
+void UTaskPool_drop(UTaskPool* p); // waits for pending tasks
+
+// t runs once all its dependencies have finished (they may be submitted
+// later). Can be called from a task.
+void UTaskPool_submit(UTaskPool* p, UTask* t);
+
+// Wait until every submitted task has finished. Returns the number of tasks
+// which raised an error since the last wait.
+S    UTaskPool_wait(UTaskPool* p);
+
+// Call fn(arg, start, end, scratch) over [0, len) in chunks of up to grain
+// indexes, in parallel on the workers. Returns when all of its chunks are done
+// (other submitted tasks may still be running). If fn raises an error no more
+// chunks are started and the first error is returned, else an empty Slc.
+typedef void (*UForFn)(void* arg, S start, S end, BBA* scratch);
+Slc  UTaskPool_for(UTaskPool* p, S len, S grain, UForFn fn, void* arg);
+
+// #################################
+// # ULogDrain: background thread draining a LogQueue
+// Drains q to f every idleNs (or continuously while there are records).
+//
+//   LogQueue q; LogQueue_init(&q, dat, sizeof(dat), LogQueue_BLOCK);
+//   ULogDrain d; ULogDrain_start(&d, &q, UFile_asFile(&f));
+//   QLogger l = QLogger_init(ring, &q, LOG_SET_INFO); civ.log = QLogger_asLogger(&l);
+//   ... log from any thread (one QLogger each) ...
+//   ULogDrain_stop(&d); // drains the rest
+typedef struct {
+  pthread_t th;
+  LogQueue* q; File f;
+  U8 idleNs; bool stop;
+} ULogDrain;
+
+#define ULogDrain_IDLE 1000000 // 1ms
+
+// Returns 0 or the errno from creating the thread.
+int  ULogDrain_start(ULogDrain* d, LogQueue* q, File f);
+void ULogDrain_stop(ULogDrain* d);
+
+// #################################
+// # UPersist: a file-backed persistent BA
+// The BA's blocks (and BANodes) live in a file which is always mapped at the
+// same base address. Pointers stored in it (the BA's free list, BBA chains,
+// application data) are therefore still valid when a later process reopens
+// the file, so state built in the blocks survives restarts without rebuilding.
+//
+// Keep a pointer to the application's data (i.e. a BBA allocated inside the
+// file) in hdr->root. Only data inside the file may be referenced from it.
+//
+// Typical use:
+//   UPersist p; UPersist_open(&p, SLC("state.civ"), UPersist_BASE, 1024);
+//   if(not p.hdr->root) { ... build, setting p.hdr->root ... }
+//   ... use p.hdr->root / &p.hdr->ba ...
+//   UPersist_close(&p);
+#if RSIZE == 4
+#define UPersist_BASE  ((void*)0x50000000)
+#else
+#define UPersist_BASE  ((void*)0x6c0000000000)
+#endif
+#define UPersist_MAGIC    0x50564943 // "CIVP"
+#define UPersist_CREATING 0x63766963 // "civc": create in progress
+
+typedef struct {
+  U4 magic; U2 blockAvail; U1 rsize; U1 intrusive; // layout checks
+  void* base; S len;          // mapped address and number of blocks
+  BA ba;                      // the persistent block allocator
+  void* root;                 // application's root object
+} UPersistHdr;
+
+typedef struct { int fd; UPersistHdr* hdr; S bytes; } UPersist;
+
+// Open (or create with numBlocks) the file at path and map it at base, which
+// must be BLOCK_SIZE aligned. When reopening, base may be NULL to use the
+// file's base and numBlocks is ignored. Only an empty file, or one marked
+// UPersist_CREATING (a create that failed or crashed), is created; the magic
+// is written last.
+//
+// Returns 0 on success, else an errno: EEXIST if base is already mapped,
+// EINVAL if the file is not a UPersist file, its base or layout don't match,
+// or it must be created and base or numBlocks is missing.
+int  UPersist_open(UPersist* p, Slc path, void* base, S numBlocks);
+
+// Write all changes to the file. Returns 0 or errno.
+int  UPersist_sync(UPersist* p);
+void UPersist_close(UPersist* p);
 
 #endif // __CIV_UNIX_H
@@ -1,3 +1,7 @@
+#include <pthread.h>
+#include <unistd.h>   // fork, unlink
+#include <sys/wait.h>
+#include <sys/stat.h>
 #include  "civ_unix.h"
 
 TEST(basic)
@@ -279,8 +283,164 @@ TEST_UNIX(ba, 5)
   TASSERT_EQ(sizeof(Block), BLOCK_SIZE);
   TASSERT_EQ(5, civ.ba.len);
   BANode* free = civ.ba.free;
-  TASSERT_EQ(free->block - 4, FIRST_BLOCK);
-  TASSERT_EQ(free->block - 1, free->next->block);
+  TASSERT_EQ(BANode_block(free) - 4, FIRST_BLOCK);
+  TASSERT_EQ(BANode_block(free) - 1, BANode_block(free->next));
+#if BA_INTRUSIVE
+  TASSERT_EQ(&BANode_block(free)->node, free);
+#endif
+END_TEST_UNIX
+
+TEST_UNIX(baReserve, 0)
+  TASSERT_EQ(0, civ.ba.len);
+  CivUnix_reserveBlocks(3 * UReserve_GROW - 1, 1);
+  UReserve* r = &civUnix.reserve;
+  TASSERT_EQ(3 * UReserve_GROW, r->cap);
+  TASSERT_EQ(UReserve_GROW, r->len); TASSERT_EQ(UReserve_GROW, civ.ba.len);
+  if(r->pages != UReserve_HUGETLB) {
+    TASSERT_EQ(0, (S)r->blocks % HUGE_PAGE_SIZE);
+  }
+
+  // Draining the free list commits another huge page worth of blocks.
+  BANode* first = NULL;
+  for(S i = 0; i < UReserve_GROW; i++) {
+    BANode* n = BA_alloc(&civ.ba); BANode_block(n)->dat[0] = i;
+    n->next = first; first = n;
+  }
+  TASSERT_EQ(0, civ.ba.len); TASSERT_EQ(UReserve_GROW, r->len);
+  BANode* n = BA_alloc(&civ.ba);
+  TASSERT_EQ(2 * UReserve_GROW, r->len);
+  TASSERT_EQ(UReserve_GROW - 1, civ.ba.len);
+  assert(BANode_block(n) >= r->blocks + UReserve_GROW);
+  BANode_block(n)->dat[BLOCK_AVAIL - 1] = 0xFF; // committed memory is writable
+
+  BA_free(&civ.ba, n); BA_freeAll(&civ.ba, first);
+  TASSERT_EQ(2 * UReserve_GROW, civ.ba.len);
+
+  // Exhausting the reservation returns NULL.
+  for(S i = 0; i < 3 * UReserve_GROW; i++) assert(BA_alloc(&civ.ba));
+  TASSERT_EQ(NULL, BA_alloc(&civ.ba));
+END_TEST_UNIX
+
+#define BA_THREADS 4
+#define BA_HOLD    100
+
+// Repeatedly take and return blocks through a thread-local cache, marking each
+// block with the thread id to detect blocks handed to two threads.
+static BA* baShared; // the test thread's civ.ba (civ is thread local)
+static void* baCacheThread(void* arg) {
+  U1 id = (U1)(S)arg;
+  BA cache = BA_cache(baShared);
+  BANode* held[BA_HOLD];
+  for(int round = 0; round < 200; round++) {
+    U1 n = (round * 7 + id) % BA_HOLD + 1;
+    for(U1 i = 0; i < n; i++) {
+      held[i] = BA_alloc(&cache); assert(held[i]);
+      memset(BANode_block(held[i])->dat, id, 64);
+    }
+    for(U1 i = 0; i < n; i++) {
+      U1* dat = BANode_block(held[i])->dat;
+      for(U1 j = 0; j < 64; j++) assert(id == dat[j]);
+      BA_free(&cache, held[i]);
+    }
+    assert(cache.len < 2 * BA_BATCH);
+  }
+  BA_dropCache(&cache);
+  assert(0 == cache.len);
+  return NULL;
+}
+
+TEST_UNIX(baCache, BA_THREADS * (BA_HOLD + 2 * BA_BATCH))
+  S total = civ.ba.len; baShared = &civ.ba;
+  pthread_t th[BA_THREADS];
+  for(S i = 0; i < BA_THREADS; i++) {
+    assert(0 == pthread_create(&th[i], NULL, baCacheThread, (void*)(i + 1)));
+  }
+  for(S i = 0; i < BA_THREADS; i++) pthread_join(th[i], NULL);
+  TASSERT_EQ(total, civ.ba.len);
+
+  // A BBA can use a cache like any BA
+  BA cache = BA_cache(&civ.ba);
+  BBA bba = { .ba = &cache };
+  assert(BBA_alloc(&bba, 10, 1));
+  TASSERT_EQ(total - BA_BATCH, civ.ba.len); TASSERT_EQ(BA_BATCH - 1, cache.len);
+  BBA_drop(&bba); BA_dropCache(&cache);
+  TASSERT_EQ(total, civ.ba.len);
+END_TEST_UNIX
+
+typedef struct { BBA bba; Vec words; } PersistRoot;
+
+// Build state in a persistent BA (in a child process, so nothing is shared
+// with the reader except the file).
+static void persistWrite(Slc path) {
+  UPersist p;
+  assert(0 == UPersist_open(&p, path, UPersist_BASE, 8));
+  TASSERT_EQ(8, p.hdr->ba.len);
+  BBA bba = { .ba = &p.hdr->ba };
+  PersistRoot* r = BBA_alloc(&bba, sizeof(PersistRoot), RSIZE);
+  r->bba = bba;
+  r->words = Vec_new(BBA_asArena(&r->bba), Slc);
+  char* words[] = {"persistent", "block", "allocator"};
+  for(int i = 0; i < 3; i++) {
+    Slc w = Slc_frNt((U1*)words[i]);
+    U1* dat = BBA_alloc(&r->bba, w.len, 1); memcpy(dat, w.dat, w.len);
+    Vec_push(&r->words, Slc, ((Slc){dat, w.len}));
+  }
+  p.hdr->root = r;
+  assert(0 == UPersist_sync(&p));
+  UPersist_close(&p);
+}
+
+TEST_UNIX(upersist, 0)
+  Slc path = SLC("bin/upersist_test.civ");
+  unlink("bin/upersist_test.civ");
+  pid_t pid = fork();
+  if(0 == pid) { persistWrite(path); _exit(0); }
+  int status; waitpid(pid, &status, 0);
+  TASSERT_EQ(0, status);
+
+  UPersist p;
+  TASSERT_EQ(0, UPersist_open(&p, path, NULL, 0));
+  TASSERT_EQ(UPersist_BASE, p.hdr->base);
+  PersistRoot* r = p.hdr->root; assert(r);
+  TASSERT_EQ(&p.hdr->ba, r->bba.ba);
+  TASSERT_EQ(3, r->words.len);
+  TASSERT_SLC_EQ("persistent", Vec_get(&r->words, Slc, 0));
+  TASSERT_SLC_EQ("allocator",  Vec_get(&r->words, Slc, 2));
+  TASSERT_EQ(7, p.hdr->ba.len);
+  BBA_drop(&r->bba); TASSERT_EQ(8, p.hdr->ba.len);
+
+  // The base address can only be mapped once
+  UPersist q;
+  TASSERT_EQ(EEXIST, UPersist_open(&q, path, NULL, 0));
+  // A failed create leaves an empty file, which the next open creates again
+  Slc fpath = SLC("bin/upersist_fail.civ"); struct stat st;
+  unlink("bin/upersist_fail.civ");
+  TASSERT_EQ(EEXIST, UPersist_open(&q, fpath, UPersist_BASE, 4));
+  TASSERT_EQ(0, stat("bin/upersist_fail.civ", &st)); TASSERT_EQ(0, st.st_size);
+  EXPECT_ERR(UPersist_open(&q, fpath, (U1*)UPersist_BASE + 1, 4), "block aligned");
+  UPersist_close(&p);
+  TASSERT_EQ(EINVAL, UPersist_open(&q, path, (U1*)UPersist_BASE + BLOCK_SIZE, 0));
+  TASSERT_EQ(0, UPersist_open(&q, fpath, UPersist_BASE, 4));
+  TASSERT_EQ(4, q.hdr->ba.len); UPersist_close(&q);
+  TASSERT_EQ(0, UPersist_open(&q, fpath, NULL, 0));
+  TASSERT_EQ(4, q.hdr->ba.len); UPersist_close(&q);
+  unlink("bin/upersist_fail.civ");
+
+  // Creating requires base and numBlocks
+  TASSERT_EQ(EINVAL, UPersist_open(&q, fpath, NULL, 0));
+  TASSERT_EQ(EINVAL, UPersist_open(&q, fpath, UPersist_BASE, 0));
+  // A foreign (non-empty) file is never overwritten
+  int fd = open("bin/upersist_fail.civ", O_WRONLY | O_TRUNC);
+  U1 zeros[512] = {0}; TASSERT_EQ(512, write(fd, zeros, 512));
+  TASSERT_EQ(EINVAL, UPersist_open(&q, fpath, UPersist_BASE, 4));
+  TASSERT_EQ(0, stat("bin/upersist_fail.civ", &st)); TASSERT_EQ(512, st.st_size);
+  // ... but an unfinished create is created again
+  U4 creating = UPersist_CREATING; TASSERT_EQ(4, pwrite(fd, &creating, 4, 0));
+  close(fd);
+  TASSERT_EQ(0, UPersist_open(&q, fpath, UPersist_BASE, 4));
+  TASSERT_EQ(UPersist_MAGIC, q.hdr->magic); TASSERT_EQ(4, q.hdr->ba.len);
+  UPersist_close(&q);
+  unlink("bin/upersist_fail.civ");
 END_TEST_UNIX
 
 TEST_UNIX(bba, 5)
@@ -298,13 +458,13 @@ TEST_UNIX(bba, 5)
   TASSERT_EQ(bytes + 5, bytes2);
   BBA_free(&bba, bytes2, 12, 1);
 
-  U4* v1 = BBA_alloc(&bba, 4, ALIGN_SLOT);
+  U4* v1 = BBA_alloc(&bba, 4, alignment(4));
   TASSERT_EQ((U1*)block + BLOCK_AVAIL - 4, (U1*) v1);
   *v1 = 0x4444;
 
   TASSERT_EQ(BLOCK_AVAIL - 4, BBA_block(&bba)->top);
   Arena a = BBA_asArena(&bba); // testing out arenas
-  Xr(a,free, v1, 4, ALIGN_SLOT);
+  Xr(a,free, v1, 4, alignment(4));
   TASSERT_EQ(BLOCK_AVAIL, BBA_block(&bba)->top);
 
   BBA_drop(&bba);
@@ -312,6 +472,309 @@ TEST_UNIX(bba, 5)
   TASSERT_EQ(5, civ.ba.len);
 END_TEST_UNIX
 
+TEST_UNIX(bbaAlign, 3)
+  BBA bba = {.ba = &civ.ba};
+  Arena a = BBA_asArena(&bba);
+  U1* x = Xr(a,alloc, 3, 1);
+  U4* y = Xr(a,alloc, 4, 4);
+  U1* v16 = Xr(a,alloc, 20, 16);
+  U1* v64 = Xr(a,alloc, 64, 64);
+  U1* v8  = Xr(a,alloc, 1, 8);
+  TASSERT_EQ(0, (S)v16 % 16); TASSERT_EQ(0, (S)v64 % 64);
+  TASSERT_EQ(0, (S)v8 % 8);
+  assert(v64 + 64 <= v16); assert(v8 + 1 <= v64);
+  memset(v16, 0x16, 20); memset(v64, 0x64, 64); *v8 = 8;
+  TASSERT_EQ(2, civ.ba.len);
+
+  // Block sized alignment takes a fresh block
+  U1* page = Xr(a,alloc, 100, BLOCK_SIZE);
+  TASSERT_EQ(0, (S)page % BLOCK_SIZE);
+  TASSERT_EQ(1, civ.ba.len);
+  TASSERT_EQ(NULL, Xr(a,free, page, 100, BLOCK_SIZE));
+  TASSERT_EQ(2, civ.ba.len);
+  EXPECT_ERR(Xr(a,alloc, BLOCK_AVAIL, 64), "sz+alignment too large");
+  TASSERT_EQ(2, civ.ba.len); // no block was taken
+
+  // Frees restore top exactly
+  assert(Xr(a,free, v64, 64, 64)); // out of order
+  TASSERT_EQ(NULL, Xr(a,free, v8, 1, 8));
+  TASSERT_EQ(NULL, Xr(a,free, v64, 64, 64));
+  TASSERT_EQ(NULL, Xr(a,free, v16, 20, 16));
+  TASSERT_EQ(BLOCK_AVAIL - 4, BBA_block(&bba)->top);
+  TASSERT_EQ(NULL, Xr(a,free, y, 4, 4));
+  TASSERT_EQ(NULL, Xr(a,free, x, 3, 1));
+  TASSERT_EQ(3, civ.ba.len);
+
+  Tlsf t = Tlsf_new(&civ.ba);
+  Arena ta = Tlsf_asArena(&t);
+  U1* p[6];
+  for(int i = 0; i < 6; i++) {
+    U2 al = 8 << i;   // 8 .. 256
+    p[i] = Xr(ta,alloc, 40, al);
+    TASSERT_EQ(0, (S)p[i] % al); memset(p[i], i, 40);
+  }
+  for(int i = 0; i < 6; i++) {
+    for(int j = 0; j < 40; j++) TASSERT_EQ(i, p[i][j]);
+    Xr(ta,free, p[i], 40, 8 << i);
+  }
+  TASSERT_EQ(3, civ.ba.len);
+
+  Slab sl = Slab_new(&civ.ba, 64);
+  U1* s64 = Slab_alloc(&sl, 64, 64);
+  TASSERT_EQ(0, (S)s64 % 64);
+  TASSERT_EQ(0, (S)Slab_alloc(&sl, 64, 64) % 64);
+  Slab_drop(&sl);
+END_TEST_UNIX
+
+TEST_UNIX(bbaMark, 4)
+  BBA bba = {.ba = &civ.ba};
+  BBAMark empty = BBA_mark(&bba);
+  U1* keep = BBA_alloc(&bba, 10, 1);
+  U4* keepA = BBA_alloc(&bba, 4, 4);
+  BBAMark m = BBA_mark(&bba);
+  for(int i = 0; i < 5; i++) assert(BBA_alloc(&bba, 1000, 1));
+  assert(BBA_alloc(&bba, 12, 4));
+  TASSERT_EQ(2, civ.ba.len);
+
+  BBA_reset(&bba, m);
+  TASSERT_EQ(3, civ.ba.len);
+  TASSERT_EQ(10, BBA_block(&bba)->bot);
+  TASSERT_EQ(BLOCK_AVAIL - 4, BBA_block(&bba)->top);
+  TASSERT_EQ(keep + 10, BBA_alloc(&bba, 5, 1)); // allocation resumes at mark
+  TASSERT_EQ(keepA - 1, BBA_alloc(&bba, 4, 4));
+
+  BBA_reset(&bba, m); BBA_reset(&bba, m); // idempotent
+  TASSERT_EQ(10, BBA_block(&bba)->bot);
+  BBA_reset(&bba, empty);
+  TASSERT_EQ(NULL, bba.dat);
+  TASSERT_EQ(4, civ.ba.len);
+END_TEST_UNIX
+
+TEST_UNIX(vec, 4)
+  BBA bba = {.ba = &civ.ba};
+  Vec v = Vec_new(BBA_asArena(&bba), U4);
+  for(U4 i = 0; i < 4; i++) Vec_push(&v, U4, i * 10);
+  TASSERT_EQ(4, v.len); TASSERT_EQ(4, v.cap);
+  U1* first = v.dat;
+  Vec_push(&v, U4, 40);                  // grows in place
+  TASSERT_EQ(first, v.dat); TASSERT_EQ(8, v.cap);
+  TASSERT_EQ(32, BBA_block(&bba)->bot);
+  TASSERT_EQ(40, Vec_last(&v, U4));
+
+  U1* other = BBA_alloc(&bba, 3, 1);     // v is no longer the latest
+  TASSERT_EQ(false, BBA_grow(&bba, v.dat, 32, 64));
+  U4 more[] = {50, 60, 70, 80};
+  assert(Vec_extend(&v, more, 4));       // copies to new storage
+  TASSERT_EQ(other + 4, v.dat);          // padded to U4 alignment
+  TASSERT_EQ(0, (S)v.dat % sizeof(U4));
+  TASSERT_EQ(16, v.cap);
+  for(U4 i = 0; i < 9; i++) TASSERT_EQ(i * 10, Vec_get(&v, U4, i));
+  TASSERT_EQ(80, Vec_pop(&v, U4)); TASSERT_EQ(8, v.len);
+
+  // Grows up to the arena's maxAlloc
+  Vec b = Vec_new(BBA_asArena(&bba), U1);
+  for(S i = 0; i < BLOCK_AVAIL; i++) Vec_push(&b, U1, i);
+  TASSERT_EQ(BLOCK_AVAIL, b.cap);
+  TASSERT_EQ(false, Vec_reserve(&b, 1));
+  TASSERT_EQ(NULL, Vec_add(&b));
+  Vec_drop(&b); Vec_drop(&v);
+  BBA_drop(&bba);
+  TASSERT_EQ(4, civ.ba.len);
+
+  // Any arena works
+  Tlsf t = Tlsf_new(&civ.ba);
+  Vec w = Vec_new(Tlsf_asArena(&t), U2);
+  for(U2 i = 0; i < 1000; i++) Vec_push(&w, U2, i);
+  for(U2 i = 0; i < 1000; i++) TASSERT_EQ(i, Vec_get(&w, U2, i));
+  Vec_drop(&w);
+  TASSERT_EQ(4, civ.ba.len);
+
+  // A padded Vec frees its padding too: the block goes back to the BA
+  BBA pb = {.ba = &civ.ba};
+  U1* odd = BBA_alloc(&pb, 3, 1);
+  Vec pv = Vec_new(BBA_asArena(&pb), U4);
+  for(U4 i = 0; i < 100; i++) Vec_push(&pv, U4, i); // grows in place
+  TASSERT_EQ(1, pv.pad); TASSERT_EQ(0, (S)pv.dat % sizeof(U4));
+  TASSERT_EQ(3, civ.ba.len);
+  Vec_drop(&pv);
+  TASSERT_EQ(NULL, BBA_free(&pb, odd, 3, 1));
+  TASSERT_EQ(4, civ.ba.len);
+END_TEST_UNIX
+
+TEST_UNIX(slab, 4)
+  Slab slab = Slab_new(&civ.ba, sizeof(Dll));
+  TASSERT_EQ(sizeof(Dll), slab.slotSz);
+  Arena a = Slab_asArena(&slab);
+  TASSERT_EQ(sizeof(Dll), Xr(a,maxAlloc));
+  S n = slab.slots * 2 + 3; // 3 blocks
+  Dll* nodes[n];
+  for(S i = 0; i < n; i++) {
+    nodes[i] = Xr(a,alloc, sizeof(Dll), RSIZE); assert(nodes[i]);
+    nodes[i]->dat = (void*)i;
+  }
+  TASSERT_EQ(1, civ.ba.len);
+  for(S i = 0; i < n; i++) TASSERT_EQ(i, (S)nodes[i]->dat);
+
+  // Free every other slot: no block is emptied, slots are reused
+  for(S i = 0; i < n; i += 2) TASSERT_EQ(NULL, Xr(a,free, nodes[i], sizeof(Dll), RSIZE));
+  TASSERT_EQ(1, civ.ba.len);
+  TASSERT_EQ(NULL, slab.full);
+  Dll* reused = Xr(a,alloc, sizeof(Dll), RSIZE);
+  bool found = false;
+  for(S i = 0; i < n; i += 2) found |= (reused == nodes[i]);
+  assert(found); Xr(a,free, reused, sizeof(Dll), RSIZE);
+
+  // A slot from another slab is rejected
+  Slab other = Slab_new(&civ.ba, 12);
+  void* o = Slab_alloc(&other, 12, RSIZE);
+  assert(Xr(a,free, o, sizeof(Dll), RSIZE));
+  Slab_free(&other, o, 12, RSIZE);
+  TASSERT_EQ(1, civ.ba.len);
+
+  // Emptied blocks go back to the BA
+  for(S i = 1; i < n; i += 2) Xr(a,free, nodes[i], sizeof(Dll), RSIZE);
+  TASSERT_EQ(4, civ.ba.len);
+  TASSERT_EQ(NULL, slab.partial);
+
+  nodes[0] = Xr(a,alloc, sizeof(Dll), RSIZE);
+  TASSERT_EQ(3, civ.ba.len);
+  Xr(a,drop);
+  TASSERT_EQ(4, civ.ba.len);
+END_TEST_UNIX
+
+TEST_UNIX(tlsf, 8)
+  Tlsf t = Tlsf_new(&civ.ba);
+  Arena a = Tlsf_asArena(&t);
+  TASSERT_EQ(NULL, Xr(a,alloc, Xr(a,maxAlloc), 64)); // no room to align
+  U1* big = Xr(a,alloc, Xr(a,maxAlloc), RSIZE); // fills a pool
+  memset(big, 0xBB, Xr(a,maxAlloc));
+  TASSERT_EQ(7, civ.ba.len);
+
+  // Mixed sizes freed in a different order than allocated
+  #define TLSF_N 64
+  U1* p[TLSF_N]; U2 sz[TLSF_N];
+  for(int i = 0; i < TLSF_N; i++) {
+    sz[i] = 1 + (i * 97) % 700;
+    p[i] = Xr(a,alloc, sz[i], RSIZE); assert(p[i]);
+    TASSERT_EQ(0, (S)p[i] % RSIZE);
+    memset(p[i], i, sz[i]);
+  }
+  for(int i = 0; i < TLSF_N; i += 3) Xr(a,free, p[i], sz[i], RSIZE);
+  for(int i = 0; i < TLSF_N; i += 3) { // reuse the holes
+    p[i] = Xr(a,alloc, sz[i], RSIZE); memset(p[i], i, sz[i]);
+  }
+  for(int i = 0; i < TLSF_N; i++) {
+    for(int j = 0; j < sz[i]; j++) TASSERT_EQ(i, p[i][j]);
+  }
+  assert(Xr(a,free, &t, 4, RSIZE));              // foreign
+  TASSERT_EQ(NULL, Xr(a,free, p[5], sz[5], RSIZE));
+  assert(Xr(a,free, p[5], sz[5], RSIZE));        // double free
+  for(int i = TLSF_N - 1; i >= 0; i -= 2) Xr(a,free, p[i], sz[i], RSIZE);
+  for(int i = 0; i < TLSF_N; i += 2) {
+    if(i != 5) Xr(a,free, p[i], sz[i], RSIZE);
+  }
+  TASSERT_EQ(7, civ.ba.len); // all but big's pool is returned
+  for(int i = 0; i < Xr(a,maxAlloc); i++) TASSERT_EQ(0xBB, big[i]);
+  Xr(a,free, big, Xr(a,maxAlloc), RSIZE);
+  TASSERT_EQ(8, civ.ba.len);
+  TASSERT_EQ(0, t.flMap);
+
+  // Dropping frees all pools
+  for(int i = 0; i < TLSF_N; i++) p[i] = Xr(a,alloc, 200, RSIZE);
+  assert(civ.ba.len < 8);
+  Xr(a,drop);
+  TASSERT_EQ(8, civ.ba.len);
+END_TEST_UNIX
+
+TEST_UNIX(arenaStats, 2)
+  BBA bba = {.ba = &civ.ba};
+  ArenaStats st = ArenaStats_new(BBA_asArena(&bba));
+  Arena a = ArenaStats_asArena(&st);
+  TASSERT_EQ(BLOCK_AVAIL, Xr(a,maxAlloc));
+  U1* x = Xr(a,alloc, 10, 1);
+  ArenaStats_tag(&st, "big");
+  U1* y = Xr(a,alloc, 3000, 1);
+  U1* z = Xr(a,alloc, 2000, 1);
+  TASSERT_EQ(5010, st.live); TASSERT_EQ(5010, st.maxLive);
+  Xr(a,free, z, 2000, 1);
+  ArenaStats_tag(&st, NULL); // frees use the tag y was allocated with
+  Xr(a,free, y, 3000, 1);
+  assert(Xr(a,free, x, 7, 1));  // errors are forwarded and not counted
+  Xr(a,free, x, 10, 1);
+  TASSERT_EQ(0, st.live); TASSERT_EQ(5010, st.maxLive);
+  TASSERT_EQ(3, st.allocs); TASSERT_EQ(3, st.frees);
+  TASSERT_EQ(1, st.hist[4]); TASSERT_EQ(2, st.hist[11] + st.hist[12]);
+  TASSERT_EQ(5000, st.tags[0].maxLive); TASSERT_EQ(0, st.tags[0].live);
+
+  BufFile_var(f, 16, 256);
+  ArenaStats_dump(&st, File_asWriter(BufFile_asFile(&f)));
+  Writer_flush(File_asWriter(BufFile_asFile(&f)));
+  TASSERT_SLC_EQ(
+    "arena: live=0 max=5010 allocs=3 frees=3 fails=0\n"
+    "  sz<=16     1\n"
+    "  sz<=2048   1\n"
+    "  sz<=4096   1\n"
+    "  [big] live=0 max=5000 allocs=2\n", *PlcBuf_asSlc(&f.b));
+  Xr(a,drop);
+
+  // Sizes pass through unchanged: exact Slab slots work
+  Slab sl = Slab_new(&civ.ba, 24);
+  ArenaStats ss = ArenaStats_new(Slab_asArena(&sl));
+  Arena sa = ArenaStats_asArena(&ss);
+  ArenaStats_tag(&ss, "slots");
+  U1* s1 = Xr(sa,alloc, 24, RSIZE); assert(s1);
+  ArenaStats_tag(&ss, "other");
+  Xr(sa,free, s1, 24, RSIZE);
+  TASSERT_EQ(24, ss.tags[0].maxLive); TASSERT_EQ(0, ss.tags[0].live);
+  assert(not ss.tags[1].name);
+  Xr(sa,drop);
+END_TEST_UNIX
+
+TEST_UNIX(buddy, 0)
+  Buddy b; CivUnix_buddy(&b, 24); // runs: 16 + 8
+  TASSERT_EQ(24, b.avail);
+  TASSERT_EQ(16 * BLOCK_SIZE, Buddy_maxAlloc(&b));
+  TASSERT_EQ(0, Buddy_order(1)); TASSERT_EQ(0, Buddy_order(BLOCK_SIZE));
+  TASSERT_EQ(1, Buddy_order(BLOCK_SIZE + 1));
+  TASSERT_EQ(3, Buddy_order(5 * BLOCK_SIZE));
+
+  Arena a = Buddy_asArena(&b);
+  U1* x = Xr(a,alloc, 3 * BLOCK_SIZE, 1);   // order 2 from the 8 run
+  TASSERT_EQ((U1*)(b.blocks + 16), x);
+  TASSERT_EQ(20, b.avail);
+  U1* y = Xr(a,alloc, BLOCK_SIZE, 1);       // order 0
+  TASSERT_EQ((U1*)(b.blocks + 20), y);
+  U1* z = Xr(a,alloc, 10 * BLOCK_SIZE, 1);  // order 4: the 16 run
+  TASSERT_EQ((U1*)b.blocks, z);
+  memset(z, 0x5A, 16 * BLOCK_SIZE);
+  TASSERT_EQ(3, b.avail);
+  TASSERT_EQ(NULL, Xr(a,alloc, 3 * BLOCK_SIZE, 1));
+  TASSERT_EQ(2 * BLOCK_SIZE, Buddy_maxAlloc(&b));
+
+  // Bad frees are rejected
+  assert(Xr(a,free, y, 2 * BLOCK_SIZE, 1));
+  assert(Xr(a,free, y + 1, BLOCK_SIZE, 1));
+  assert(Xr(a,free, &b, BLOCK_SIZE, 1));
+
+  // Frees coalesce back to the original runs
+  TASSERT_EQ(NULL, Xr(a,free, x, 3 * BLOCK_SIZE, 1));
+  TASSERT_EQ(NULL, Xr(a,free, y, BLOCK_SIZE, 1));
+  TASSERT_EQ(8 * BLOCK_SIZE, Buddy_maxAlloc(&b));
+  assert(Xr(a,free, y, BLOCK_SIZE, 1)); // double free (y was merged into x's run)
+  TASSERT_EQ(8 * BLOCK_SIZE, Buddy_maxAlloc(&b)); TASSERT_EQ(8, b.avail);
+  TASSERT_EQ(NULL, Xr(a,free, z, 10 * BLOCK_SIZE, 1));
+  TASSERT_EQ(24, b.avail);
+  TASSERT_EQ(16 * BLOCK_SIZE, Buddy_maxAlloc(&b));
+
+  // Many small allocations, freed in a scrambled order
+  U1* p[24];
+  for(int i = 0; i < 24; i++) { p[i] = Xr(a,alloc, 1, 1); assert(p[i]); }
+  TASSERT_EQ(0, b.avail);
+  for(int i = 0; i < 24; i++) Xr(a,free, p[(i * 7) % 24], 1, 1);
+  TASSERT_EQ(24, b.avail);
+  TASSERT_EQ(16 * BLOCK_SIZE, Buddy_maxAlloc(&b));
+END_TEST_UNIX
+
 TEST_UNIX(CStr, 2)
   BBA bba = {.ba = &civ.ba};
   Slc expected = SLC("this is from a slice.");
@@ -418,6 +881,918 @@ TEST(fileWrite)
   EXPECT_ERR(UFile_write(&f), "operation out of order");
 END_TEST
 
+// Read f until EOF, spinning on the non-blocking pipe.
+static void readPipe(UFile* f, Buf* b) {
+  File file = UFile_asFile(f);
+  while(not File_eof(file)) {
+    File_consume(file, b);
+    ASSERT(b->len < b->cap, "readPipe: buf full");
+  }
+  UFile_close(f);
+}
+
+TEST(uproc)
+  Ring_var(inR, 8);
+  Ring_var(outR, 8);
+  Ring_var(errR, 8);
+  UProc p = {0};
+  char* argv[] = {"sh", "-c", "tr a-z A-Z; echo oops >&2; exit 3", NULL};
+  TASSERT_EQ(0, UProc_spawn(&p, argv, inR, outR, errR));
+
+  File in = UFile_asFile(&p.in);
+  File_extend(in, SLC("hello pipes, ")); File_extend(in, SLC("from civ"));
+  File_flush(in); UFile_close(&p.in);
+
+  Buf_var(out, 64); readPipe(&p.out, &out);
+  TASSERT_SLC_EQ("HELLO PIPES, FROM CIV", *Buf_asSlc(&out));
+  Buf_var(err, 64); readPipe(&p.err, &err);
+  TASSERT_SLC_EQ("oops\n", *Buf_asSlc(&err));
+  TASSERT_EQ(3, UProc_wait(&p));
+
+  // inherited streams
+  UProc q = {0};
+  char* argvT[] = {"true", NULL};
+  TASSERT_EQ(0, UProc_spawn(&q, argvT, (Ring){0}, (Ring){0}, (Ring){0}));
+  TASSERT_EQ(File_CLOSED, q.out.code);
+  TASSERT_EQ(0, UProc_wait(&q));
+
+  // A failed spawn doesn't depend on p being initialized
+  memset(&q, 0x5A, sizeof(q));
+  char* argvX[] = {"civ-no-such-program", NULL};
+  TASSERT_EQ(ENOENT, UProc_spawn(&q, argvX, inR, outR, (Ring){0}));
+  TASSERT_EQ(File_CLOSED, q.in.code); TASSERT_EQ(File_CLOSED, q.out.code);
+  TASSERT_EQ(File_CLOSED, q.err.code);
+END_TEST
+
+// Compress dat through an LzWriter and decompress it back with an LzReader,
+// using small rings to exercise the streaming state. Returns compressed len.
+static U2 lzRoundTrip(Slc dat, Buf* out) {
+  BufFile_var(cf, 16, 0x4000);
+  Ring_var(wr, 20);
+  LzWriter zw;
+  assert(LzWriter_init(&zw, wr, File_asWriter(BufFile_asFile(&cf)), &civ.ba));
+  Writer w = LzWriter_asWriter(&zw);
+  for(U2 i = 0; i < dat.len; i += 100) {
+    Writer_extend(w, (Slc){dat.dat + i, U4_min(100, dat.len - i)});
+  }
+  Writer_flush(w); LzWriter_drop(&zw);
+
+  U1 srcDat[8];
+  BufFile src = BufFile_init(Ring_init(srcDat, 8),
+    (Buf){.dat = cf.b.dat, .len = cf.b.len, .cap = cf.b.len});
+  Ring_var(rr, 10);
+  LzReader zr;
+  assert(LzReader_init(&zr, rr, File_asReader(BufFile_asFile(&src)), &civ.ba));
+  Reader r = LzReader_asReader(&zr);
+  while(not Reader_eof(r)) {
+    Reader_consume(r, out);
+    ASSERT(zr.code <= File_EOF, "lz: decompress error");
+    ASSERT(out->len < out->cap, "lz: decompressed too much");
+  }
+  LzReader_drop(&zr);
+  TASSERT_EQ(dat.len, out->len);
+  assert(0 == memcmp(dat.dat, out->dat, dat.len));
+  return cf.b.len;
+}
+
+TEST_UNIX(lz, 4)
+  Slc txt = SLC("the quick brown fox jumps over the lazy dog. "
+                "the lazy dog sleeps; the quick brown fox jumps again. ");
+  Buf_var(dat, 10000);
+  Buf_var(out, 10100);
+  while(dat.len + txt.len <= dat.cap) Buf_extend(&dat, txt);
+  U2 clen = lzRoundTrip(*Buf_asSlc(&dat), &out);
+  assert(clen < dat.len / 20);
+  TASSERT_EQ(4, civ.ba.len);
+
+  // Noisy data (little to compress) and runs
+  U4 seed = 42; Buf_clear(&dat); Buf_clear(&out);
+  while(not Buf_isFull(&dat)) {
+    seed = seed * 1103515245 + 12345;
+    if(seed & 0x10000) Buf_add(&dat, 'a' + ((seed >> 16) & 0xF));
+    else for(U1 i = 0; i < 8 and not Buf_isFull(&dat); i++) Buf_add(&dat, 'z');
+  }
+  clen = lzRoundTrip(*Buf_asSlc(&dat), &out);
+  assert(clen < dat.len);
+
+  // Empty stream
+  Buf_clear(&out); TASSERT_EQ(0, lzRoundTrip((Slc){0}, &out));
+
+  // Corrupt streams: a zero offset, and one before the decoded data
+  U1 bad[2][6] = { {0x01, 'a', 'b', 0x80, 0x00, 0x00},
+                   {0x01, 'a', 'b', 0x80, 0x00, 0x03} };
+  for(int i = 0; i < 2; i++) {
+    BufFile src = BufFile_init(Ring_init(out.dat, 8), (Buf){bad[i], 6, 6});
+    Ring_var(rr, 10);
+    LzReader zr;
+    assert(LzReader_init(&zr, rr, File_asReader(BufFile_asFile(&src)), &civ.ba));
+    LzReader_read(&zr);
+    TASSERT_EQ(File_ERROR, zr.code);
+    TASSERT_EQ(0, Ring_cmpSlc(&zr.ring, SLC("ab")));
+    LzReader_drop(&zr);
+  }
+END_TEST_UNIX
+
+TEST(crc32c)
+  TASSERT_EQ(0xE3069283, crc32c    (0, SLC("123456789")));
+  TASSERT_EQ(0xE3069283, crc32cSoft(0, SLC("123456789")));
+  TASSERT_EQ(0xE3069283, crc32c(crc32c(0, SLC("1234")), SLC("56789")));
+  TASSERT_EQ(0, crc32c(0, (Slc){0}));
+
+  Buf_var(dat, 1000);
+  for(U2 i = 0; i < dat.cap; i++) Buf_add(&dat, i * 7 + (i >> 3));
+  U4 expect = crc32cSoft(0, *Buf_asSlc(&dat));
+  TASSERT_EQ(expect, crc32c(0, *Buf_asSlc(&dat)));
+  for(U2 i = 1; i < 9; i++) { // unaligned starts
+    Slc s = Buf_slc(&dat, i, dat.len - i);
+    TASSERT_EQ(crc32cSoft(0, s), crc32c(0, s));
+  }
+
+  // Writer: checksum what flows to dst
+  BufFile_var(f, 15, 1024);
+  CrcWriter cw = CrcWriter_init(File_asWriter(BufFile_asFile(&f)));
+  Writer w = CrcWriter_asWriter(&cw);
+  Writer_extend(w, Buf_slc(&dat, 0, 333));
+  Writer_extend(w, Buf_slc(&dat, 333, dat.len));
+  Writer_flush(w);
+  TASSERT_EQ(expect, cw.crc);
+  TASSERT_EQ(0, Slc_cmp(*Buf_asSlc(&dat), *PlcBuf_asSlc(&f.b)));
+
+  // Reader: checksum what flows from src
+  U1 ringDat[17];
+  BufFile src = BufFile_init(Ring_init(ringDat, 17), dat);
+  CrcReader cr = CrcReader_init(File_asReader(BufFile_asFile(&src)));
+  Reader r = CrcReader_asReader(&cr);
+  Buf_var(out, 1100);
+  while(not Reader_eof(r)) Reader_consume(r, &out);
+  TASSERT_EQ(expect, cr.crc);
+  TASSERT_EQ(0, Slc_cmp(*Buf_asSlc(&dat), *Buf_asSlc(&out)));
+END_TEST
+
+TEST(tee)
+  BufFile_var(a, 4, 256);
+  BufFile_var(b, 4, 256);
+  UFile uf = UFile_malloc(4);
+  Slc path = SLC("bin/tee_test.txt");
+  UFile_open(&uf, path, File_WRONLY | File_CREATE | File_TRUNC);
+  TeeSink sinks[] = {
+    { .f = BufFile_asFile(&a) }, { .f = BufFile_asFile(&b) },
+    { .f = UFile_asFile(&uf) },
+  };
+  Ring_var(tr, 10);
+  TeeWriter t = TeeWriter_init(tr, sinks, 3);
+  Writer w = TeeWriter_asWriter(&t);
+
+  // BufFile only writes the 1st part of a wrapped ring, so sinks lag the head.
+  t.ring.head = 8; t.ring.tail = 8;
+  Writer_extend(w, SLC("hello "));
+  Xr(w,write);
+  TASSERT_SLC_EQ("hel", *PlcBuf_asSlc(&a.b));
+  TASSERT_EQ(0, sinks[0].sent); TASSERT_EQ(0, sinks[2].sent);
+  TASSERT_EQ(3, Ring_len(&t.ring));
+  Writer_extend(w, SLC("tee writer!")); Writer_flush(w);
+  TASSERT_EQ(File_DONE, t.code); TASSERT_EQ(0, Ring_len(&t.ring));
+  TASSERT_SLC_EQ("hello tee writer!", *PlcBuf_asSlc(&a.b));
+  TASSERT_SLC_EQ("hello tee writer!", *PlcBuf_asSlc(&b.b));
+  TASSERT_EQ(0, Ring_len(&a.ring)); TASSERT_EQ(5, a.ring._cap);
+  UFile_close(&uf);
+
+  UFile_open(&uf, path, File_RDONLY); UFile_readAll(&uf); // ring cap=3
+  TASSERT_RING_EQ("hel", &uf.ring);
+  UFile_close(&uf); free(uf.ring.dat);
+END_TEST
+
+// Yields 0..n-1 to its caller, one per switch.
+typedef struct { Fiber* main; S n; S out; } Gen;
+static void genFn(void* arg) {
+  Gen* g = arg;
+  for(g->out = 0; g->out < g->n; g->out++) Fiber_switch(g->main);
+}
+
+static void countFn(void* arg) {
+  S* count = arg;
+  for(int i = 0; i < 3; i++) { *count += 1; Fiber_switch(civ.fb->caller); }
+}
+
+static void errFn(void* arg) {
+  ASSERT(false, "fiber failed");
+}
+
+TEST_UNIX(fiber, 128)
+  Fiber* main = civ.fb;
+  Buddy buddy; CivUnix_buddy(&buddy, 64);
+  Arena stacks = Buddy_asArena(&buddy);
+
+  Fiber g; Gen gen = { .main = main, .n = 5 };
+  assert(Fiber_alloc(&g, stacks, 4 * BLOCK_SIZE, genFn, &gen));
+  TASSERT_EQ(0, (S)g.stack % 16);
+  for(S i = 0; i < 5; i++) {
+    Fiber_switch(&g);
+    TASSERT_EQ(main, civ.fb); TASSERT_EQ(i, gen.out);
+  }
+  Fiber_switch(&g); // returns
+  TASSERT_EQ(Fiber_DONE, g.state);
+  Fiber_free(&g, stacks);
+
+  // Errors in a fiber are caught and end it
+  Fiber e;
+  assert(Fiber_alloc(&e, stacks, 4 * BLOCK_SIZE, errFn, NULL));
+  e.state |= Fiber_EXPECT_ERR;
+  Fiber_switch(&e);
+  TASSERT_EQ(Fiber_DONE | Fiber_ERR, e.state & (Fiber_DONE | Fiber_ERR));
+  TASSERT_SLC_EQ("fiber failed", e.err);
+  EXPECT_ERR(Fiber_switch(&e), "fiber is done");
+  Fiber_free(&e, stacks);
+
+  // Many small fibers with single block stacks, interleaved
+  #define FIBERS 200
+  BBA bba = {.ba = &civ.ba};
+  Fiber* fibers = Xr(stacks,alloc, FIBERS * sizeof(Fiber), 16); assert(fibers);
+  S count = 0;
+  for(int i = 0; i < FIBERS; i++) {
+    assert(Fiber_alloc(&fibers[i], BBA_asArena(&bba), 1800, countFn, &count));
+  }
+  for(int round = 0; round < 4; round++) {
+    for(int i = 0; i < FIBERS; i++) Fiber_switch(&fibers[i]);
+  }
+  TASSERT_EQ(3 * FIBERS, count);
+  for(int i = 0; i < FIBERS; i++) TASSERT_EQ(Fiber_DONE, fibers[i].state);
+  BBA_drop(&bba);
+END_TEST_UNIX
+
+typedef struct { Buf* log; U1 id; Fiber* join; Fiber* wake; } Task;
+
+static void taskFn(void* arg) {
+  Task* t = arg;
+  if(t->join) Sched_join(t->join);
+  for(int i = 0; i < 2; i++) {
+    t->log->dat[t->log->len++] = t->id;
+    Sched_yield();
+  }
+  if(t->wake) Sched_unpark(t->wake);
+}
+
+static void parkFn(void* arg) {
+  Task* t = arg;
+  Sched_park();
+  t->log->dat[t->log->len++] = t->id;
+}
+
+TEST_UNIX(sched, 8)
+  BBA bba = {.ba = &civ.ba};
+  Arena stacks = BBA_asArena(&bba);
+  Buf_var(log, 32);
+  Sched s; Sched_init(&s);
+  Fiber f[4];
+  Task t[4] = {
+    { .log = &log, .id = 'a' },
+    { .log = &log, .id = 'b', .wake = &f[3] },
+    { .log = &log, .id = 'c', .join = &f[0] },
+    { .log = &log, .id = 'p' },
+  };
+  for(int i = 0; i < 3; i++) {
+    assert(Fiber_alloc(&f[i], stacks, 3000, taskFn, &t[i]));
+  }
+  assert(Fiber_alloc(&f[3], stacks, 3000, parkFn, &t[3]));
+  for(int i = 0; i < 4; i++) Sched_spawn(&s, &f[i]);
+
+  Fiber* main = civ.fb;
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(main, civ.fb); TASSERT_EQ(NULL, civ.sched);
+  // a and b interleave, c waits for a and p is woken when b is done
+  TASSERT_SLC_EQ("ababcpc", *Buf_asSlc(&log));
+  for(int i = 0; i < 4; i++) {
+    TASSERT_EQ(Fiber_DONE, f[i].state); assert(f[i].ran > 0);
+  }
+
+  // A fiber parked forever is reported
+  log.len = 0;
+  assert(Fiber_alloc(&f[0], stacks, 3000, parkFn, &t[3]));
+  Sched_spawn(&s, &f[0]);
+  TASSERT_EQ(1, Sched_run(&s));
+  TASSERT_EQ(0, log.len);
+  BBA_drop(&bba);
+END_TEST_UNIX
+
+// Check each timer fires exactly at its tick (tickNs = 1).
+static S timerCount;
+static void timerFn(Timer* t) {
+  TimerWheel* w = t->arg;
+  TASSERT_EQ(t->at, w->tick);
+  timerCount += 1;
+}
+
+TEST(timerWheel)
+  TimerWheel w; TimerWheel_init(&w, 1, 0);
+  U8 ats[] = { 5, 63, 64, 100, 4095, 4096, 5000, 300000, TIMER_SPAN + 1000 };
+  #define TIMERS (sizeof(ats) / sizeof(U8))
+  Timer t[TIMERS + 1] = {0};
+  for(int i = 0; i <= TIMERS; i++) {
+    t[i] = (Timer) { .fn = timerFn, .arg = &w };
+    TimerWheel_add(&w, &t[i], (i < TIMERS) ? ats[i] : 70);
+  }
+  TASSERT_EQ(TIMERS + 1, w.len); TASSERT_EQ(5, TimerWheel_next(&w));
+  TimerWheel_cancel(&w, &t[TIMERS]); TimerWheel_cancel(&w, &t[TIMERS]);
+  TASSERT_EQ(TIMERS, w.len); TASSERT_EQ(false, Timer_pending(&t[TIMERS]));
+
+  TASSERT_EQ(0, TimerWheel_advance(&w, 4));
+  TASSERT_EQ(1, TimerWheel_advance(&w, 5));
+  TASSERT_EQ(63, TimerWheel_next(&w));
+  TASSERT_EQ(6, TimerWheel_advance(&w, 10000)); TASSERT_EQ(10000, w.tick);
+  TASSERT_EQ(2, TimerWheel_advance(&w, TIMER_SPAN * 2));
+  TASSERT_EQ(TIMERS, timerCount); TASSERT_EQ(0, w.len);
+  TASSERT_EQ((U8)-1, TimerWheel_next(&w));
+
+  // A time in the past fires at the next advance. Ticks round up.
+  TimerWheel_init(&w, 1000, 5500);
+  TimerWheel_add(&w, &t[0], 10); TASSERT_EQ(6, t[0].at);
+  TimerWheel_add(&w, &t[1], 7001); TASSERT_EQ(8, t[1].at);
+  TASSERT_EQ(1, TimerWheel_advance(&w, 6000));
+  TASSERT_EQ(0, TimerWheel_advance(&w, 7999));
+  TASSERT_EQ(1, TimerWheel_advance(&w, 8000));
+  #undef TIMERS
+END_TEST
+
+#define MS 1000000
+typedef struct { Buf* log; U1 id; U8 sleep; bool timedOut; } Sleeper;
+
+static void sleepFn(void* arg) {
+  Sleeper* sl = arg;
+  Sched_sleep(sl->sleep * MS);
+  sl->log->dat[sl->log->len++] = sl->id;
+}
+
+static void waitFn(void* arg) {
+  Sleeper* sl = arg;
+  sl->timedOut = Sched_parkUntil(civ.now() + sl->sleep * MS);
+  sl->log->dat[sl->log->len++] = sl->id;
+}
+
+static void wakeFn(void* arg) {
+  Sched_sleep(15 * MS);
+  Sched_unpark(arg);
+}
+
+TEST_UNIX(schedTimers, 8)
+  BBA bba = {.ba = &civ.ba};
+  Arena stacks = BBA_asArena(&bba);
+  Buf_var(log, 8);
+  TimerWheel w; TimerWheel_init(&w, MS, civ.now());
+  Sched s; Sched_init(&s); s.timers = &w;
+  Fiber f[5];
+  Sleeper sl[4] = {
+    { .log = &log, .id = 'c', .sleep = 30 },
+    { .log = &log, .id = 'a', .sleep = 10 },
+    { .log = &log, .id = 'b', .sleep = 20 },
+    { .log = &log, .id = 'w', .sleep = 1000 }, // woken at 15ms
+  };
+  for(int i = 0; i < 3; i++) assert(Fiber_alloc(&f[i], stacks, 3000, sleepFn, &sl[i]));
+  assert(Fiber_alloc(&f[3], stacks, 3000, waitFn, &sl[3]));
+  assert(Fiber_alloc(&f[4], stacks, 3000, wakeFn, &f[3]));
+  for(int i = 0; i < 5; i++) Sched_spawn(&s, &f[i]);
+
+  U8 start = civ.now();
+  TASSERT_EQ(0, Sched_run(&s));
+  U8 took = civ.now() - start;
+  TASSERT_SLC_EQ("awbc", *Buf_asSlc(&log));
+  TASSERT_EQ(false, sl[3].timedOut); TASSERT_EQ(0, w.len);
+  assert(took >= 30 * MS); assert(took < 500 * MS);
+
+  // A timeout
+  sl[3].sleep = 5;
+  assert(Fiber_alloc(&f[3], stacks, 3000, waitFn, &sl[3]));
+  Sched_spawn(&s, &f[3]);
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(true, sl[3].timedOut);
+  BBA_drop(&bba);
+END_TEST_UNIX
+
+#define PIPE_CHUNKS 200
+typedef struct { UFile* f; S bytes; S reads; bool ready[2]; } PipeEnd;
+
+// Write more than the pipe holds: parks whenever it is full.
+static void pipeWriteFn(void* arg) {
+  PipeEnd* e = arg;
+  U1 chunk[1000];
+  for(int c = 0; c < PIPE_CHUNKS; c++) {
+    for(int i = 0; i < 1000; i++) chunk[i] = (c * 1000 + i) % 251;
+    UFile_extend(e->f, (Slc){chunk, 1000});
+    e->bytes += 1000;
+  }
+  while(not Ring_isEmpty(&e->f->ring)) UFile_write(e->f);
+  UFile_close(e->f);
+}
+
+static void pipeReadFn(void* arg) {
+  PipeEnd* e = arg; Ring* r = &e->f->ring;
+  do {
+    UFile_read(e->f); e->reads += 1;
+    for(U1* c; (c = Ring_next(r)); e->bytes++) assert(*c == e->bytes % 251);
+  } while(e->f->code != File_EOF);
+}
+
+static void pollTimeoutFn(void* arg) {
+  PipeEnd* e = arg;
+  e->ready[0] = UPoller_wait(e->f->fid, UPoll_IN, civ.now() + 5 * MS);
+  e->ready[1] = UPoller_wait(e->f->fid, UPoll_IN, civ.now() + 1000 * MS);
+}
+
+// Wait (without a timeout) for a byte and consume it.
+static void pollByteFn(void* arg) {
+  PipeEnd* e = arg; U1 c;
+  e->ready[e->reads] = UPoller_wait(e->f->fid, UPoll_IN, 0);
+  e->bytes += read(e->f->fid, &c, 1); e->reads += 1;
+}
+
+// A read on an idle pipe gives up at the file's deadline.
+static void pipeDeadlineFn(void* arg) {
+  PipeEnd* e = arg; U8 start = civ.now();
+  e->f->deadline = start + 5 * MS;
+  UFile_read(e->f);
+  e->ready[0] = (File_ETIMEDOUT == e->f->code);
+  e->ready[1] = (civ.now() - start >= 5 * MS) and Ring_isEmpty(&e->f->ring);
+  e->f->deadline = 0;
+}
+
+static void pipeByteFn(void* arg) {
+  Sched_sleep(10 * MS);
+  UFile* w = arg; UFile_extend(w, SLC("!"));
+}
+
+TEST_UNIX(poller, 12)
+  BBA bba = {.ba = &civ.ba};
+  Arena stacks = BBA_asArena(&bba);
+  TimerWheel tw; TimerWheel_init(&tw, MS, civ.now());
+  Sched s; Sched_init(&s); s.timers = &tw;
+  UPoller p; TASSERT_EQ(0, UPoller_init(&p, &s));
+  Ring_var(rRing, 1024);
+  Ring_var(wRing, 1500);
+  UFile r = UFile_new(rRing), w = UFile_new(wRing);
+  TASSERT_EQ(0, UFile_pipe(&r, &w));
+
+  Fiber f[2];
+  PipeEnd re = {.f = &r}, we = {.f = &w};
+  assert(Fiber_alloc(&f[0], stacks, 4000, pipeReadFn,  &re));
+  assert(Fiber_alloc(&f[1], stacks, 4000, pipeWriteFn, &we));
+  for(int i = 0; i < 2; i++) Sched_spawn(&s, &f[i]);
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(PIPE_CHUNKS * 1000, we.bytes);
+  TASSERT_EQ(PIPE_CHUNKS * 1000, re.bytes);
+  assert(re.reads < re.bytes / 100); // it waited instead of spinning
+  TASSERT_EQ(0, s.ioWaits);
+  UFile_close(&r);
+
+  // Waits time out
+  TASSERT_EQ(0, UFile_pipe(&r, &w));
+  assert(Fiber_alloc(&f[0], stacks, 4000, pollTimeoutFn, &re));
+  assert(Fiber_alloc(&f[1], stacks, 4000, pipeByteFn, &w));
+  for(int i = 0; i < 2; i++) Sched_spawn(&s, &f[i]);
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(false, re.ready[0]); TASSERT_EQ(true, re.ready[1]);
+  UFile_close(&r); UFile_close(&w);
+
+  // UFile reads time out at the file's deadline
+  TASSERT_EQ(0, UFile_pipe(&r, &w));
+  assert(Fiber_alloc(&f[0], stacks, 4000, pipeDeadlineFn, &re));
+  Sched_spawn(&s, &f[0]);
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(true, re.ready[0]); TASSERT_EQ(true, re.ready[1]);
+  // The timed out wait is unregistered: the peer closing reports nothing
+  UFile_close(&w);
+  struct epoll_event ev; TASSERT_EQ(0, epoll_wait(p.epfd, &ev, 1, 0));
+  UFile_close(&r);
+
+  // Woken waits are unregistered too: a different fiber can wait next
+  TASSERT_EQ(0, UFile_pipe(&r, &w));
+  re = (PipeEnd) {.f = &r};
+  for(int i = 0; i < 2; i++) {
+    assert(Fiber_alloc(&f[0], stacks, 4000, pollByteFn, &re));
+    assert(Fiber_alloc(&f[1], stacks, 4000, pipeByteFn, &w));
+    for(int j = 0; j < 2; j++) Sched_spawn(&s, &f[j]);
+    TASSERT_EQ(0, Sched_run(&s));
+    TASSERT_EQ(-1, epoll_ctl(p.epfd, EPOLL_CTL_DEL, r.fid, NULL)); // not registered
+    TASSERT_EQ(ENOENT, errno);
+  }
+  TASSERT_EQ(2, re.bytes); assert(re.ready[0] and re.ready[1]);
+  UFile_close(&r); UFile_close(&w);
+
+  // Outside of a fiber: no waiting
+  EXPECT_ERR(UPoller_wait(0, UPoll_IN, 0), "not in a polled fiber");
+  UPoller_drop(&p);
+  BBA_drop(&bba);
+END_TEST_UNIX
+
+typedef struct { PtrChan* in; PtrChan* out; S n; S sum; } Stage;
+#define CHAN_N 20
+
+static void produceFn(void* arg) {
+  Stage* st = arg;
+  for(S i = 1; i <= CHAN_N; i++) PtrChan_send(st->out, (void*)i);
+  PtrChan_close(st->out);
+}
+
+static void doubleFn(void* arg) {
+  Stage* st = arg;
+  for(void* p; (p = PtrChan_recv(st->in)); ) {
+    assert(st->in->len <= st->in->cap);
+    PtrChan_send(st->out, (void*)((S)p * 2));
+  }
+  PtrChan_close(st->out);
+}
+
+static void sumFn(void* arg) {
+  Stage* st = arg;
+  for(void* p; (p = PtrChan_recv(st->in)); ) { st->sum += (S)p; st->n += 1; }
+}
+
+// Receive from every case until all are closed.
+static void selectFn(void* arg) {
+  Stage* st = arg;
+  ChanCase cases[] = { {.ch = &st->in[0]}, {.ch = &st->in[1]} };
+  for(U2 len = 2; len; ) {
+    U2 i = PtrChan_select(cases, len);
+    if(not cases[i].p) { cases[i] = cases[--len]; continue; }
+    st->sum += (S)cases[i].p; st->n += 1;
+  }
+}
+
+static void sendBytesFn(void* arg) {
+  Chan* c = arg;
+  for(int i = 0; i < 30; i++) Chan_send(c, SLC("0123456789"));
+  Chan_close(c);
+}
+
+// Park sending to a full channel, which is then closed.
+typedef struct { PtrChan* p; Chan* c; bool pSent; bool cSent; void* selP; } ClosedSend;
+
+static void sendClosedFn(void* arg) {
+  ClosedSend* cs = arg;
+  cs->pSent = PtrChan_send(cs->p, (void*)2);
+  cs->cSent = Chan_send(cs->c, SLC("xyz"));
+  ChanCase cases[] = {{.ch = cs->p, .op = Chan_SEND, .p = (void*)3}};
+  TASSERT_EQ(0, PtrChan_select(cases, 1)); cs->selP = cases[0].p;
+}
+
+static void closeFn(void* arg) {
+  ClosedSend* cs = arg;
+  Sched_yield(); TASSERT_EQ(1, cs->p->len); PtrChan_close(cs->p);
+  Sched_yield(); TASSERT_EQ(0, Ring_remain(&cs->c->ring)); Chan_close(cs->c);
+}
+
+static void recvBytesFn(void* arg) {
+  Buf* out = arg;
+  Chan* c = ((Chan**)out->dat)[0]; out->len = 0;
+  Buf_var(b, 7);
+  while(Chan_recv(c, &b)) {
+    memcpy(out->dat + out->len, b.dat, b.len); out->len += b.len; b.len = 0;
+  }
+}
+
+TEST_UNIX(chan, 12)
+  BBA bba = {.ba = &civ.ba};
+  Arena stacks = BBA_asArena(&bba);
+  Sched s; Sched_init(&s);
+  Fiber f[4];
+
+  // A 3 stage pipeline over small channels
+  void* aBuf[2]; PtrChan a = PtrChan_init(aBuf, 2);
+  void* bBuf[2]; PtrChan b = PtrChan_init(bBuf, 2);
+  Stage st[3] = { {.out = &a}, {.in = &a, .out = &b}, {.in = &b} };
+  assert(Fiber_alloc(&f[0], stacks, 3000, produceFn, &st[0]));
+  assert(Fiber_alloc(&f[1], stacks, 3000, doubleFn,  &st[1]));
+  assert(Fiber_alloc(&f[2], stacks, 3000, sumFn,     &st[2]));
+  for(int i = 2; i >= 0; i--) Sched_spawn(&s, &f[i]);
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(CHAN_N, st[2].n);
+  TASSERT_EQ(CHAN_N * (CHAN_N + 1), st[2].sum);
+  assert(not PtrChan_send(&a, (void*)1)); assert(not PtrChan_trySend(&a, (void*)1));
+
+  // select over two producers
+  void* xBuf[1]; void* yBuf[3]; PtrChan xy[2] = {
+    PtrChan_init(xBuf, 1), PtrChan_init(yBuf, 3) };
+  Stage px = {.out = &xy[0]}, py = {.out = &xy[1]}, sel = {.in = xy};
+  assert(Fiber_alloc(&f[0], stacks, 3000, selectFn,  &sel));
+  assert(Fiber_alloc(&f[1], stacks, 3000, produceFn, &px));
+  assert(Fiber_alloc(&f[2], stacks, 3000, produceFn, &py));
+  for(int i = 0; i < 3; i++) Sched_spawn(&s, &f[i]);
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(2 * CHAN_N, sel.n);
+  TASSERT_EQ(CHAN_N * (CHAN_N + 1), sel.sum);
+
+  // select performs the first case which can proceed, without parking
+  void* zBuf[1]; PtrChan z = PtrChan_init(zBuf, 1);
+  void* wBuf[1]; PtrChan w = PtrChan_init(wBuf, 1);
+  ChanCase cases[] = {
+    {.ch = &z, .op = Chan_SEND, .p = (void*)1}, {.ch = &w, .op = Chan_RECV}};
+  TASSERT_EQ(0, PtrChan_select(cases, 2)); TASSERT_EQ(1, z.len);
+  assert(PtrChan_trySend(&w, (void*)7));
+  TASSERT_EQ(1, PtrChan_select(cases, 2)); TASSERT_EQ(7, (S)cases[1].p);
+  EXPECT_ERR(PtrChan_recv(&w), "would block outside a Sched");
+  TASSERT_EQ(NULL, w.w.recvs);
+
+  // Bytes stream through a small Ring
+  Ring_var(r, 16); Chan c = Chan_init(r);
+  U1 outDat[400]; Buf out = {.dat = outDat, .cap = 400};
+  ((Chan**)outDat)[0] = &c;
+  assert(Fiber_alloc(&f[0], stacks, 3000, recvBytesFn, &out));
+  assert(Fiber_alloc(&f[1], stacks, 3000, sendBytesFn, &c));
+  for(int i = 0; i < 2; i++) Sched_spawn(&s, &f[i]);
+  TASSERT_EQ(0, Sched_run(&s));
+  TASSERT_EQ(300, out.len);
+  for(int i = 0; i < 300; i++) TASSERT_EQ('0' + i % 10, out.dat[i]);
+
+  // Parked senders are woken by close and fail
+  void* pBuf[1] = {(void*)1}; PtrChan pc = PtrChan_init(pBuf, 1); pc.len = 1;
+  Ring_var(cr, 16); Chan cc = Chan_init(cr);
+  while(Ring_remain(&cc.ring)) Ring_push(&cc.ring, 'a');
+  ClosedSend cs = { .p = &pc, .c = &cc, .pSent = true, .cSent = true, .selP = pBuf };
+  assert(Fiber_alloc(&f[0], stacks, 3000, sendClosedFn, &cs));
+  assert(Fiber_alloc(&f[1], stacks, 3000, closeFn, &cs));
+  for(int i = 0; i < 2; i++) Sched_spawn(&s, &f[i]);
+  TASSERT_EQ(0, Sched_run(&s));
+  assert(not cs.pSent); assert(not cs.cSent); TASSERT_EQ(NULL, cs.selP);
+  TASSERT_EQ(Fiber_DONE, f[0].state); TASSERT_EQ(1, pc.len);
+  BBA_drop(&bba);
+END_TEST_UNIX
+
+#define DQ_ITEMS   20000
+#define DQ_THIEVES 3
+typedef struct { Deque* d; Fiber* items; U1* taken; S stolen; } DqThief;
+
+static void* dequeThief(void* arg) {
+  DqThief* t = arg;
+  while(__atomic_load_n(&t->taken[DQ_ITEMS], __ATOMIC_ACQUIRE) == 0) {
+    Fiber* fb = Deque_steal(t->d);
+    if(fb) { __atomic_add_fetch(&t->taken[fb - t->items], 1, __ATOMIC_RELAXED); t->stolen++; }
+  }
+  return NULL;
+}
+
+TEST_UNIX(deque, 2)
+  Fiber* buf[8]; Fiber f[10];
+  Deque d = Deque_init(buf, 8);
+  for(int i = 0; i < 8; i++) assert(Deque_push(&d, &f[i]));
+  TASSERT_EQ(false, Deque_push(&d, &f[8]));        // full
+  TASSERT_EQ(&f[0], Deque_steal(&d));               // thieves take the oldest
+  TASSERT_EQ(&f[7], Deque_pop(&d));                 // owner the newest
+  assert(Deque_push(&d, &f[8])); assert(Deque_push(&d, &f[9]));
+  TASSERT_EQ(&f[9], Deque_pop(&d));
+  TASSERT_EQ(&f[1], Deque_steal(&d));
+  for(int i = 0; i < 6; i++) assert(Deque_pop(&d));
+  TASSERT_EQ(NULL, Deque_pop(&d)); TASSERT_EQ(NULL, Deque_steal(&d));
+
+  // Concurrent: every item is taken exactly once
+  Fiber* items = malloc(DQ_ITEMS * sizeof(Fiber));
+  U1* taken = calloc(DQ_ITEMS + 1, 1); // last: done flag
+  Fiber* big[256]; Deque q = Deque_init(big, 256);
+  DqThief th[DQ_THIEVES]; pthread_t tid[DQ_THIEVES];
+  for(int i = 0; i < DQ_THIEVES; i++) {
+    th[i] = (DqThief) { .d = &q, .items = items, .taken = taken };
+    assert(0 == pthread_create(&tid[i], NULL, dequeThief, &th[i]));
+  }
+  S next = 0;
+  while(next < DQ_ITEMS) {
+    for(int i = 0; i < 5 and next < DQ_ITEMS; i++) {
+      if(Deque_push(&q, &items[next])) next++;
+    }
+    Fiber* fb = Deque_pop(&q);
+    if(fb) __atomic_add_fetch(&taken[fb - items], 1, __ATOMIC_RELAXED);
+  }
+  for(Fiber* fb; (fb = Deque_pop(&q)); )
+    __atomic_add_fetch(&taken[fb - items], 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&taken[DQ_ITEMS], 1, __ATOMIC_RELEASE);
+  for(int i = 0; i < DQ_THIEVES; i++) pthread_join(tid[i], NULL);
+  for(S i = 0; i < DQ_ITEMS; i++) TASSERT_EQ(1, taken[i]);
+  free(items); free(taken);
+END_TEST_UNIX
+
+#define POOL_FIBERS 64
+typedef struct { U4 n; U8 sum; Fiber* fb; } PoolJob;
+
+static void poolFn(void* arg) {
+  PoolJob* j = arg;
+  BANode* scratch = BA_alloc(&civ.ba); // the worker's own BA cache
+  assert(scratch);
+  for(U4 i = 1; i <= j->n; i++) {
+    j->sum += i;
+    assert(UPool_civ()->fb == j->fb);
+    if(i % 100 == 0) UPool_yield();
+  }
+  BA_free(&UPool_civ()->ba, scratch); // maybe a different worker's cache
+}
+
+static void poolSlowFn(void* arg) { usleep(200000); }
+
+typedef struct { UPool* p; Fiber* child; bool local; bool moved; } PoolErr;
+
+static void poolChildFn(void* arg) {
+  for(int i = 0; i < 2000; i++) UPool_yield();
+}
+
+// Spawns a child onto its worker's Deque, then errors after changing threads.
+static void poolErrFn(void* arg) {
+  PoolErr* e = arg;
+  UPool_spawn(e->p, e->child);
+  e->local = not __atomic_load_n(&e->p->inject, __ATOMIC_RELAXED);
+  // A yielding fiber is only briefly in its Deque: wait until it is stolen.
+  Civ* start = UPool_civ();
+  while(start == UPool_civ()) UPool_yield();
+  e->moved = true;
+  UPool_civ()->fb->state |= Fiber_EXPECT_ERR;
+  ASSERT(false, "error after moving");
+}
+
+TEST_UNIX(upool, 128)
+  S blocks = civ.ba.len;
+  BBA bba = {.ba = &civ.ba};
+  Fiber fibers[POOL_FIBERS]; PoolJob jobs[POOL_FIBERS];
+  UPool p; UWorker w[4]; UPool_init(&p, w, 4);
+  for(int i = 0; i < POOL_FIBERS; i++) {
+    jobs[i] = (PoolJob) { .n = 1000 + i, .fb = &fibers[i] };
+    assert(Fiber_alloc(&fibers[i], BBA_asArena(&bba), 1800, poolFn, &jobs[i]));
+    UPool_spawn(&p, &fibers[i]);
+  }
+  Fiber* main = civ.fb;
+  TASSERT_EQ(0, UPool_run(&p));
+  TASSERT_EQ(main, civ.fb); TASSERT_EQ(0, p.live);
+  S ran = 0;
+  for(int i = 0; i < 4; i++) ran += w[i].ran;
+  TASSERT_EQ(POOL_FIBERS * 11, ran); // 10 yields each
+  for(int i = 0; i < POOL_FIBERS; i++) {
+    U8 n = jobs[i].n;
+    TASSERT_EQ(n * (n + 1) / 2, jobs[i].sum);
+    TASSERT_EQ(Fiber_DONE, fibers[i].state);
+  }
+
+  // Idle workers sleep instead of spinning while a fiber blocks
+  UPool_init(&p, w, 4);
+  Fiber slow; assert(Fiber_alloc(&slow, BBA_asArena(&bba), 1800, poolSlowFn, NULL));
+  UPool_spawn(&p, &slow);
+  struct timespec c0, c1; clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+  TASSERT_EQ(0, UPool_run(&p));
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+  U8 cpuMs = (c1.tv_sec - c0.tv_sec) * 1000 + (c1.tv_nsec - c0.tv_nsec) / 1000000;
+  assert(cpuMs < 100); // spinning would take ~3 * 200ms
+
+  // An error after a fiber changed threads ends that fiber (not its worker)
+  UPool_init(&p, w, 4);
+  Fiber errFb, child; PoolErr pe = { .p = &p, .child = &child };
+  assert(Fiber_alloc(&errFb, BBA_asArena(&bba), 1800, poolErrFn, &pe));
+  assert(Fiber_alloc(&child, BBA_asArena(&bba), 1800, poolChildFn, NULL));
+  UPool_spawn(&p, &errFb);
+  TASSERT_EQ(0, UPool_run(&p));
+  assert(pe.local); assert(pe.moved);
+  TASSERT_EQ(Fiber_DONE | Fiber_ERR | Fiber_EXPECT_ERR, errFb.state);
+  TASSERT_SLC_EQ("error after moving", errFb.err);
+  TASSERT_EQ(Fiber_DONE, child.state);
+  BBA_drop(&bba);
+  TASSERT_EQ(blocks, civ.ba.len);
+END_TEST_UNIX
+
+#define CIV_THREADS 4
+typedef struct { Civ* from; BA* shared; U1 id; } CivThreadArg;
+
+// A thread with its own civ: blocks come through its cache of the shared BA
+// and errors longjmp through its own root fiber.
+static void* civThread(void* arg) {
+  CivThreadArg* a = arg;
+  jmp_buf errJmp; Fiber root; Fiber_init(&root, &errJmp);
+  if(setjmp(errJmp)) { eprintf("!! civThread failed with error !!\n"); exit(1); }
+  CivUnix_initThread(&root, a->from, a->shared);
+  assert(civ.fb == &root); assert(civ.ba.parent == a->shared);
+  assert(civ.logLvl == a->from->logLvl);
+  assert(civ.logFile.d == &civUnixIO.logFile);
+
+  BBA bba = BBA_new();
+  for(int round = 0; round < 50; round++) {
+    U1* dat[100];
+    for(int i = 0; i < 100; i++) {
+      dat[i] = BBA_alloc(&bba, 200, 1); assert(dat[i]);
+      memset(dat[i], a->id, 200);
+    }
+    for(int i = 0; i < 100; i++) assert(a->id == dat[i][0] and a->id == dat[i][199]);
+    BBA_drop(&bba);
+  }
+  EXPECT_ERR(SET_ERR(SLC("thread error")), "thread error");
+  CivUnix_dropThread();
+  assert(0 == civ.ba.len);
+  return NULL;
+}
+
+TEST_UNIX(civThreads, 256)
+  S blocks = civ.ba.len;
+  BBA mine = BBA_new(); assert(BBA_alloc(&mine, 100, 1));
+  BA shared; Civ_share(&shared);
+  TASSERT_EQ(&shared, civ.ba.parent);
+  Civ from = civ;
+  CivThreadArg args[CIV_THREADS]; pthread_t th[CIV_THREADS];
+  for(int i = 0; i < CIV_THREADS; i++) {
+    args[i] = (CivThreadArg) { .from = &from, .shared = &shared, .id = i + 1 };
+    assert(0 == pthread_create(&th[i], NULL, civThread, &args[i]));
+  }
+  // Meanwhile this thread's BBA keeps working through its own cache.
+  for(int i = 0; i < 2000; i++) assert(BBA_alloc(&mine, 100, 1));
+  for(int i = 0; i < CIV_THREADS; i++) pthread_join(th[i], NULL);
+  TASSERT_EQ(from.fb, civ.fb);
+  BBA_drop(&mine);
+  Civ_unshare(&shared);
+  TASSERT_EQ(NULL, civ.ba.parent);
+  TASSERT_EQ(blocks, civ.ba.len);
+END_TEST_UNIX
+
+typedef struct { U4* dat; U8 sum; S chunks; } ForSum;
+
+static void forSumFn(void* arg, S start, S end, BBA* scratch) {
+  ForSum* f = arg; U8 sum = 0;
+  assert(1 == BBA_used(scratch)); // reset after every chunk
+  U4* tmp = BBA_alloc(scratch, 256 * sizeof(U4), sizeof(U4)); assert(tmp);
+  for(S i = start; i < end; i++) { tmp[i % 256] = f->dat[i]; sum += tmp[i % 256]; }
+  __atomic_add_fetch(&f->sum, sum, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&f->chunks, 1, __ATOMIC_RELAXED);
+}
+
+static void forFailFn(void* arg, S start, S end, BBA* scratch) {
+  __atomic_add_fetch((S*)arg, 1, __ATOMIC_RELAXED);
+  civ.fb->state |= Fiber_EXPECT_ERR;
+  ASSERT(start != 3000, "chunk 3 failed");
+  civ.fb->state &= ~Fiber_EXPECT_ERR;
+}
+
+// Runs until released, so UTaskPool_for must not wait for it.
+static void blockFn(UTask* t, BBA* scratch) {
+  while(not __atomic_load_n((bool*)t->arg, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static void failFn(UTask* t, BBA* scratch) {
+  civ.fb->state |= Fiber_EXPECT_ERR;
+  SET_ERR(SLC("task failed"));
+}
+
+static S taskSeq;
+static void seqFn(UTask* t, BBA* scratch) {
+  assert(BBA_alloc(scratch, 100, 1));
+  *(S*)t->arg = __atomic_add_fetch(&taskSeq, 1, __ATOMIC_RELAXED);
+}
+
+TEST_UNIX(taskPool, 256)
+  S blocks = civ.ba.len;
+  UTaskPool p; UTaskWorker w[4];
+  TASSERT_EQ(0, UTaskPool_init(&p, w, 4));
+  assert(civ.ba.parent == &p.shared);
+
+  #define FOR_LEN 100000
+  ForSum f = { .dat = malloc(FOR_LEN * sizeof(U4)) };
+  U8 expect = 0;
+  for(S i = 0; i < FOR_LEN; i++) { f.dat[i] = i * 7; expect += i * 7; }
+  UTaskPool_for(&p, FOR_LEN, 1000, forSumFn, &f);
+  TASSERT_EQ(expect, f.sum); TASSERT_EQ(FOR_LEN / 1000, f.chunks);
+  f.sum = 0; f.chunks = 0;
+  UTaskPool_for(&p, 10, 1000, forSumFn, &f); // a single chunk
+  TASSERT_EQ(1, f.chunks); TASSERT_EQ(7 * 45, f.sum);
+  free(f.dat);
+
+  // UTaskPool_for only waits for its own chunks
+  bool release = false; UTask blocker = UTask_init(blockFn, &release);
+  UTaskPool_submit(&p, &blocker);
+  S calls = 0;
+  TASSERT_SLC_EQ("", UTaskPool_for(&p, 10, 1, forFailFn, &calls));
+  TASSERT_EQ(10, calls); TASSERT_EQ(1, p.pending);
+  __atomic_store_n(&release, true, __ATOMIC_RELEASE);
+  TASSERT_EQ(0, UTaskPool_wait(&p));
+  // An error stops starting chunks and is returned. The chunk count doesn't
+  // overflow for a huge len.
+  calls = 0;
+  TASSERT_SLC_EQ("chunk 3 failed", UTaskPool_for(&p, 100000, 1000, forFailFn, &calls));
+  assert(calls >= 4 and calls < 100);
+  calls = 0;
+  TASSERT_SLC_EQ("chunk 3 failed", UTaskPool_for(&p, (S)-1, 1000, forFailFn, &calls));
+  assert(calls >= 4 and calls < 100);
+
+  // A task's error is stored in it and counted, instead of exiting
+  UTask bad = UTask_init(failFn, NULL);
+  UTaskPool_submit(&p, &bad);
+  TASSERT_EQ(1, UTaskPool_wait(&p));
+  TASSERT_SLC_EQ("task failed", bad.err);
+  TASSERT_EQ(0, UTaskPool_wait(&p));
+
+  // A diamond: a -> (b, c) -> d, submitted in reverse
+  S seq[4] = {0}; UTask t[4];
+  for(int i = 0; i < 4; i++) t[i] = UTask_init(seqFn, &seq[i]);
+  UTask_after(&t[1], &t[0]); UTask_after(&t[2], &t[0]);
+  UTask_after(&t[3], &t[1]); UTask_after(&t[3], &t[2]);
+  for(int i = 3; i >= 0; i--) UTaskPool_submit(&p, &t[i]);
+  UTaskPool_wait(&p);
+  TASSERT_EQ(1, seq[0]); TASSERT_EQ(4, seq[3]);
+  assert(seq[1] > 1 and seq[1] < 4); assert(seq[2] > 1 and seq[2] < 4);
+  TASSERT_EQ(0, p.pending);
+
+  UTaskPool_drop(&p);
+  S ran = 0; for(int i = 0; i < 4; i++) ran += w[i].ran;
+  assert(ran >= 4 + 1 + 4);
+  TASSERT_EQ(NULL, civ.ba.parent);
+  TASSERT_EQ(blocks, civ.ba.len);
+END_TEST_UNIX
+
 TEST_UNIX(log, 5)
   BBA bba = {.ba = &civ.ba}; Arena a = BBA_asArena(&bba);
   BufFile_var(f, 15, 256);
@@ -433,7 +1808,7 @@ TEST_UNIX(log, 5)
   TASSERT_SLC_EQ("[WARN] " MSG "\n", *PlcBuf_asSlc(&f.b));
   #undef MSG
 
-  UFile_extend(&civUnix.logFile, SLC("* civUnix.logFile write works\n"));
+  UFile_extend(&civUnixIO.logFile, SLC("* civUnixIO.logFile write works\n"));
   File_extend(civ.logFile,       SLC("* civ.logFile     write works\n"));
   File_flush(civ.logFile);
   assert(Xr(civ.log,start, LOG_INFO));
@@ -443,6 +1818,222 @@ TEST_UNIX(log, 5)
 
 END_TEST
 
+#define LQ_THREADS 4
+#define LQ_RECORDS 300
+typedef struct { LogQueue* q; U1 id; } LqProducer;
+
+// BLOCK from a fiber: waits for a drain fiber on the same Sched.
+typedef struct { LogQueue* q; File f; bool done; } LqFibers;
+
+static void lqPushFn(void* arg) {
+  LqFibers* lf = arg;
+  for(int i = 0; i < 40; i++) {
+    U1 msg[8]; int n = snprintf(msg, sizeof(msg), "%04d", i);
+    Slc parts[3] = { (Slc){msg, n}, (Slc){0}, SLC(".....\n") };
+    assert(LogQueue_push(lf->q, parts, 3));
+  }
+  lf->done = true;
+}
+
+static void lqDrainFn(void* arg) {
+  LqFibers* lf = arg;
+  while(not lf->done) { LogQueue_drain(lf->q, lf->f); Sched_yield(); }
+  LogQueue_drain(lf->q, lf->f);
+}
+
+static void* lqProducer(void* arg) {
+  LqProducer* p = arg;
+  jmp_buf errJmp; Fiber root; Fiber_init(&root, &errJmp);
+  Civ_init(&root, LOG_SET_INFO); civ.sleep = CivUnix_sleep;
+  if(setjmp(errJmp)) { eprintf("!! lqProducer failed with error !!\n"); exit(1); }
+  Ring_var(r, 32);
+  QLogger ql = QLogger_init(r, p->q, LOG_SET_INFO);
+  civ.log = QLogger_asLogger(&ql);
+  for(int i = 0; i < LQ_RECORDS; i++) {
+    U1 msg[16]; int n = snprintf(msg, sizeof(msg), "%c %04d", p->id, i);
+    assert(Xr(civ.log,start, LOG_INFO));
+    Xr(civ.log,add, (Slc){msg, n}); Xr(civ.log,end);
+  }
+  return NULL;
+}
+
+TEST_UNIX(logQueue, 4)
+  // DROP: records which don't fit are counted
+  U4 qDat[64]; LogQueue q; LogQueue_init(&q, (U1*)qDat, 256, LogQueue_DROP);
+  Ring_var(lr, 40);
+  QLogger ql = QLogger_init(lr, &q, LOG_SET_INFO);
+  Logger l = QLogger_asLogger(&ql);
+  TASSERT_EQ(false, Xr(l,start, LOG_DEBUG));
+  for(U1 c = 'a'; c < 'a' + 20; c++) {
+    assert(Xr(l,start, LOG_INFO));
+    Xr(l,add, SLC("record ")); Xr(l,add, (Slc){&c, 1}); Xr(l,end);
+  }
+  TASSERT_EQ(8, q.dropped); // 12 records of 4 + 16 bytes fit
+  BufFile_var(f, 64, 1024);
+  TASSERT_EQ(12, LogQueue_drain(&q, BufFile_asFile(&f)));
+  TASSERT_EQ(0, LogQueue_drain(&q, BufFile_asFile(&f)));
+  Slc out = *PlcBuf_asSlc(&f.b);
+  TASSERT_EQ(12 * 16, out.len);
+  TASSERT_SLC_EQ("[INFO] record a\n", ((Slc){out.dat, 16}));
+  TASSERT_SLC_EQ("[INFO] record l\n", ((Slc){out.dat + 11 * 16, 16}));
+
+  // Wraps (with padding) and truncates records longer than the ring
+  Buf_clear(PlcBuf_asBuf(&f.b));
+  for(int i = 0; i < 5; i++) {
+    assert(Xr(l,start, LOG_WARN)); Xr(l,add, SLC("wrap")); Xr(l,end);
+  }
+  assert(Xr(l,start, LOG_ERROR));
+  Writer_extend(QLogger_asWriter(&ql), SLC("0123456789012345678901234567890123456789"));
+  Xr(l,end);
+  TASSERT_EQ(6, LogQueue_drain(&q, BufFile_asFile(&f)));
+  TASSERT_SLC_EQ(
+      "[WARN] wrap\n[WARN] wrap\n[WARN] wrap\n[WARN] wrap\n[WARN] wrap\n"
+      "[!ERR] 012345678901234567890123456789012\n", *PlcBuf_asSlc(&f.b));
+
+  // BLOCK: several threads through a small queue, drained in the background
+  U4 bDat[256]; LogQueue bq; LogQueue_init(&bq, (U1*)bDat, 1024, LogQueue_BLOCK);
+  BufFile_var(bf, 256, 30000);
+  ULogDrain d; TASSERT_EQ(0, ULogDrain_start(&d, &bq, BufFile_asFile(&bf)));
+  pthread_t th[LQ_THREADS]; LqProducer prod[LQ_THREADS];
+  for(int i = 0; i < LQ_THREADS; i++) {
+    prod[i] = (LqProducer) { .q = &bq, .id = 'A' + i };
+    assert(0 == pthread_create(&th[i], NULL, lqProducer, &prod[i]));
+  }
+  for(int i = 0; i < LQ_THREADS; i++) pthread_join(th[i], NULL);
+  ULogDrain_stop(&d);
+  TASSERT_EQ(0, bq.dropped);
+  // Every thread's records arrive whole and in order
+  Slc all = *PlcBuf_asSlc(&bf.b); S next[LQ_THREADS] = {0};
+  TASSERT_EQ(LQ_THREADS * LQ_RECORDS * 14, all.len);
+  for(U2 i = 0; i < all.len; i += 14) {
+    U1* line = all.dat + i;
+    assert(0 == memcmp(line, "[INFO] ", 7)); TASSERT_EQ('\n', line[13]);
+    U1 t = line[7] - 'A'; assert(t < LQ_THREADS);
+    U1 n[5] = {0}; memcpy(n, line + 9, 4);
+    TASSERT_EQ(next[t], (S)atoi(n)); next[t] += 1;
+  }
+
+  // BLOCK between fibers of one Sched (civ.sleep would block the drain fiber)
+  LogQueue_init(&q, (U1*)qDat, 64, LogQueue_BLOCK);
+  Buf_clear(PlcBuf_asBuf(&f.b));
+  LqFibers lf = { .q = &q, .f = BufFile_asFile(&f) };
+  BBA bba = {.ba = &civ.ba}; Sched s; Sched_init(&s); Fiber lqf[2];
+  assert(Fiber_alloc(&lqf[0], BBA_asArena(&bba), 4000, lqPushFn,  &lf));
+  assert(Fiber_alloc(&lqf[1], BBA_asArena(&bba), 4000, lqDrainFn, &lf));
+  for(int i = 0; i < 2; i++) Sched_spawn(&s, &lqf[i]);
+  TASSERT_EQ(0, Sched_run(&s));
+  out = *PlcBuf_asSlc(&f.b);
+  TASSERT_EQ(40 * 10, out.len);
+  TASSERT_SLC_EQ("0000.....\n", ((Slc){out.dat, 10}));
+  TASSERT_SLC_EQ("0039.....\n", ((Slc){out.dat + 390, 10}));
+  BBA_drop(&bba);
+END_TEST_UNIX
+
+void binLogBadConv(BinLogger* l) { BLOG(l, LOG_INFO, "bad %Lf", 1.0L); }
+void binLogBadStar(BinLogger* l) { BLOG(l, LOG_INFO, "bad %*d", 3, 1); }
+
+// Threads race to register the same call site, each into its own stream.
+#define BINLOG_THREADS 4
+typedef struct { BinLogger l; U1* go; } BinLogRace;
+static void* binLogRace(void* arg) {
+  BinLogRace* r = arg;
+  while(not __atomic_load_n(r->go, __ATOMIC_ACQUIRE)) {}
+  for(int i = 0; i < 10; i++)
+    BLOG(&r->l, LOG_INFO, "race %i %s %f", i, "str", 0.25);
+  return NULL;
+}
+
+// Decode a corrupt stream: it stops with err, after `lines` lines.
+static void binLogCorrupt(Slc stream, S lines, char* err, S recPos) {
+  U1 dat[256], rDat[17]; memcpy(dat, stream.dat, stream.len);
+  BufFile in = BufFile_init(Ring_init(rDat, 17), (Buf){dat, stream.len, 256});
+  BBA bba = {.ba = &civ.ba};
+  BinLogDec d = BinLogDec_init(File_asReader(BufFile_asFile(&in)), BBA_asArena(&bba));
+  BufFile_var(out, 64, 256);
+  S n = 0; while(BinLogDec_next(&d, File_asWriter(BufFile_asFile(&out)))) n++;
+  TASSERT_EQ(lines, n);
+  assert(0 == Slc_cmp(Slc_frNt((U1*)err), d.err)); TASSERT_EQ(recPos, d.recPos);
+  TASSERT_EQ(false, BinLogDec_next(&d, File_asWriter(BufFile_asFile(&out))));
+  BBA_drop(&bba);
+}
+
+TEST_UNIX(binLog, 2)
+  BufFile_var(f, 64, 1024);
+  BinLogger l = BinLogger_init(BufFile_asFile(&f), LOG_SET_INFO);
+  for(int i = 0; i < 3; i++) BLOG(&l, LOG_INFO, "loop %i of %u", i, 3);
+  File_flush(BufFile_asFile(&f));
+  // The definition (7 + 13 fmt bytes) is only written once, before its first
+  // record (2 id + 8 time + 4 + 4 args bytes).
+  TASSERT_EQ(20 + 3 * 18, f.b.len);
+  BLOG(&l, LOG_DEBUG, "not logged %i", 1);
+  TASSERT_EQ(20 + 3 * 18, f.b.len);
+
+  Slc path = SLC("data/UFile_test.txt");
+  BLOG(&l, LOG_WARN, "%s: %.*s is %5.2f%% done (%lld, %-4x|, %c)",
+       "read", Dat_fmt(path), 12.5, (long long)-1, 0xab, 'z');
+  BLOG(&l, LOG_ERROR, "%zu bytes, %hd, %.3e, %.3s", (size_t)1234567, (short)-3,
+       0.5, "truncated");
+  EXPECT_ERR(binLogBadConv(&l), "unsupported conversion");
+  EXPECT_ERR(binLogBadStar(&l), "only supported in %.*s");
+  File_flush(BufFile_asFile(&f));
+
+  // Decode the stream as a reader
+  f.b.plc = 0; f.code = File_DONE; Ring_clear(&f.ring);
+  BBA bba = {.ba = &civ.ba};
+  BinLogDec d = BinLogDec_init(File_asReader(BufFile_asFile(&f)), BBA_asArena(&bba));
+  BufFile_var(out, 64, 1024);
+  Writer w = File_asWriter(BufFile_asFile(&out));
+  while(BinLogDec_next(&d, w)) {}
+  Writer_flush(w);
+  TASSERT_SLC_EQ(
+    "[INFO] loop 0 of 3\n"
+    "[INFO] loop 1 of 3\n"
+    "[INFO] loop 2 of 3\n"
+    "[WARN] read: data/UFile_test.txt is 12.50% done (-1, ab  |, z)\n"
+    "[!ERR] 1234567 bytes, -3, 5.000e-01, tru\n", *PlcBuf_asSlc(&out.b));
+
+  // Every racing thread's records have the full args
+  BufFile_var(rf0, 64, 1024);
+  BufFile_var(rf1, 64, 1024);
+  BufFile_var(rf2, 64, 1024);
+  BufFile_var(rf3, 64, 1024);
+  BufFile* rf[BINLOG_THREADS] = {&rf0, &rf1, &rf2, &rf3};
+  BinLogRace race[BINLOG_THREADS]; pthread_t th[BINLOG_THREADS]; U1 go = 0;
+  for(int i = 0; i < BINLOG_THREADS; i++) {
+    race[i] = (BinLogRace) { BinLogger_init(BufFile_asFile(rf[i]), LOG_SET_INFO), &go };
+    assert(0 == pthread_create(&th[i], NULL, binLogRace, &race[i]));
+  }
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  for(int i = 0; i < BINLOG_THREADS; i++) pthread_join(th[i], NULL);
+  BBAMark mark = BBA_mark(&bba);
+  for(int i = 0; i < BINLOG_THREADS; i++) {
+    BBA_reset(&bba, mark);
+    File_flush(BufFile_asFile(rf[i]));
+    rf[i]->b.plc = 0; rf[i]->code = File_DONE; Ring_clear(&rf[i]->ring);
+    d = BinLogDec_init(File_asReader(BufFile_asFile(rf[i])), BBA_asArena(&bba));
+    Buf_clear(PlcBuf_asBuf(&out.b));
+    for(int n = 0; n < 10; n++) assert(BinLogDec_next(&d, w));
+    TASSERT_EQ(false, BinLogDec_next(&d, w));
+    Writer_flush(w);
+    Slc lines = *PlcBuf_asSlc(&out.b);
+    TASSERT_SLC_EQ("[INFO] race 0 str 0.250000\n", ((Slc){lines.dat, 27}));
+    TASSERT_EQ(10 * 27, lines.len);
+  }
+  BBA_drop(&bba);
+
+  // Corrupt streams stop the decoder with an error (from the first stream:
+  // a 20 byte definition of "loop %i of %u", then 18 byte records).
+  TASSERT_EQ(0, d.err.len);
+  U1* good = f.b.dat; U1 bad[40];
+  binLogCorrupt((Slc){good, 20 + 18 + 5}, 1, "BinLogDec: truncated record", 38);
+  binLogCorrupt((Slc){good, 20 + 18 + 1}, 1, "BinLogDec: truncated record", 38);
+  binLogCorrupt((Slc){good + 20, 18},     0, "BinLogDec: undefined id", 0);
+  memcpy(bad, good, 38); bad[13] = 'q'; // "loop %q of %u"
+  binLogCorrupt((Slc){bad, 38}, 0, "BinLog: unsupported conversion", 0);
+  memcpy(bad, good, 38); bad[2] = 0xFF; bad[3] = 0xFF;
+  binLogCorrupt((Slc){bad, 38}, 0, "BinLogDec: bad id", 0);
+END_TEST_UNIX
+
 int main(int argc, char *argv[]) {
   ARGV = argv;
   SETUP_SIG((void *)defaultHandleSig);
@@ -458,12 +2049,38 @@ int main(int argc, char *argv[]) {
   test_dll();
   test_bst();
   test_ba();
+  test_baReserve();
+  test_baCache();
+  test_upersist();
   test_bba();
+  test_bbaAlign();
+  test_bbaMark();
+  test_vec();
+  test_slab();
+  test_tlsf();
+  test_buddy();
+  test_arenaStats();
   test_CStr();
   test_bufFile();
   test_fileRead();
   test_fileWrite();
+  test_uproc();
+  test_lz();
+  test_crc32c();
+  test_tee();
+  test_fiber();
+  test_sched();
+  test_timerWheel();
+  test_schedTimers();
+  test_poller();
+  test_chan();
+  test_deque();
+  test_upool();
+  test_civThreads();
+  test_taskPool();
   test_log();
+  test_logQueue();
+  test_binLog();
   eprintf("# Tests All Pass\n");
   return 0;
 }
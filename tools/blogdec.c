@@ -0,0 +1,44 @@
+// blogdec: decode a BinLogger stream into text log lines.
+//
+//   blogdec [-t] [path]
+//
+// Reads path (or stdin) and writes the lines to stdout. -t prefixes each line
+// with its time (seconds.nanoseconds from civ.now when it was logged).
+
+#include "civ_unix.h"
+
+int main(int argc, char *argv[]) {
+  ARGV = argv;
+  SETUP_SIG((void *)defaultHandleSig);
+  jmp_buf errJmp; Fiber fb;
+  Fiber_init(&fb, &errJmp); Civ_init(&fb, LOG_SET_INFO);
+  if(setjmp(errJmp)) { eprintf("!! blogdec: %.*s\n", Dat_fmt(fb.err)); exit(1); }
+  CivUnix_init(16);
+
+  bool time = false; char* path = NULL;
+  for(int i = 1; i < argc; i++) {
+    if(0 == strcmp(argv[i], "-t")) time = true;
+    else if(not path)              path = argv[i];
+    else { eprintf("usage: blogdec [-t] [path]\n"); exit(2); }
+  }
+
+  U1 dat[4096]; UFile f = UFile_new(Ring_init(dat, sizeof(dat)));
+  if(path) {
+    UFile_open(&f, (Slc) { .dat = path, .len = strlen(path) }, File_RDONLY);
+    ASSERT(f.code == File_DONE, "blogdec: could not open file");
+  } else { f.fid = fileno(stdin); f.code = File_DONE; }
+
+  BBA bba = { .ba = &civ.ba };
+  BinLogDec d = BinLogDec_init(File_asReader(UFile_asFile(&f)), BBA_asArena(&bba));
+  d.time = time;
+  while(BinLogDec_next(&d, File_asWriter(civ.outFile))) {}
+  File_flush(civ.outFile);
+  if(d.err.len) {
+    eprintf("!! blogdec: %.*s (record at byte %zu)\n", Dat_fmt(d.err), (size_t)d.recPos);
+    exit(1);
+  }
+  if(path) UFile_close(&f);
+  BBA_drop(&bba);
+  CivUnix_drop();
+  return 0;
+}